@@ -2,20 +2,40 @@
 
 set -e
 
-server_boost_libs="-lboost_system -lboost_thread -lboost_serialization"
-client_boost_libs="-lpthread "$server_boost_libs
-cc_flags="-Wall -O2 -std=c++11"
+server_boost_libs="-lpthread -lboost_system -lboost_thread"
+client_boost_libs=$server_boost_libs
+cc_flags="-Wall -O2 -DNDEBUG -std=c++11"
+if [ "$1" = "--debug" ]; then
+  cc_flags="-Wall -O0 -g -std=c++11"  # Keeps asserts
+fi
 
 echo -ne "Creating bin folder...\t"
 mkdir -p bin
 echo "Done."
 
 echo -ne "Compiling Server...\t"
-g++ $cc_flags $server_boost_libs -o bin/server src/ttt_server.cpp
+g++ $cc_flags -o bin/server src/ttt_server.cpp $server_boost_libs
 echo "Done."
 
 echo -ne "Compiling Client...\t"
-g++ $cc_flags $client_boost_libs -o bin/client src/ttt_client.cpp
+g++ $cc_flags -o bin/client src/ttt_client.cpp $client_boost_libs
+echo "Done."
+
+echo -ne "Compiling Simulator...\t"
+g++ $cc_flags -o bin/simulator src/ttt_simulator.cpp $client_boost_libs
+echo "Done."
+
+echo -ne "Compiling History...\t"
+g++ $cc_flags -o bin/history src/ttt_history.cpp $client_boost_libs
+g++ $cc_flags -o bin/history_test src/ttt_history_test.cpp $client_boost_libs
+echo "Done."
+
+echo -ne "Compiling Loadgen...\t"
+g++ $cc_flags -o bin/loadgen src/ttt_loadgen.cpp $client_boost_libs
+echo "Done."
+
+echo -ne "Testing History...\t"
+bin/history_test > /dev/null
 echo "Done."
 
 echo "All is well."
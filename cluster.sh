@@ -0,0 +1,31 @@
+#!/bin/bash
+
+set -e
+
+# Runs a local cluster: a front door on <port> and <nodes> room servers
+# on the ports right after it. Clients join through the front door with
+# 'bin/client localhost <port> <room>'. Stop everything with Ctrl-C.
+
+front_port=${1:-9000}
+n_nodes=${2:-3}
+
+if [ ! -x bin/server ]; then
+  echo "bin/server is missing, run ./build.sh first"
+  exit 1
+fi
+
+pids=()
+trap 'kill "${pids[@]}" 2>/dev/null' EXIT
+
+nodes=()
+for i in $(seq 1 "$n_nodes"); do
+  port=$((front_port + i))
+  bin/server --rooms "$port" &
+  pids+=($!)
+  nodes+=("127.0.0.1:$port")
+done
+
+bin/server --front "$front_port" "${nodes[@]}" &
+pids+=($!)
+
+wait
@@ -0,0 +1,82 @@
+#!/bin/bash
+
+# End-to-end performance gate. Starts bin/server with a fixed config,
+# plays a scripted game in many rooms over loopback with bin/loadgen,
+# and compares throughput, latency, memory and CPU per move against
+# the baseline recorded on this host. Build with ./build.sh first.
+#
+#   ./perf.sh           Fails if anything regressed beyond its tolerance.
+#                       The first run on a host records its baseline.
+#   ./perf.sh --record  Makes this run the new baseline of this host
+
+set -e
+
+port=${TTT_PERF_PORT:-9400}
+rooms=64
+warmup=2
+seconds=4
+runs=5
+idle=1000
+# Numbers only compare on the machine they were measured on
+baseline=perf/baseline-$(hostname).json
+
+for binary in bin/server bin/loadgen; do
+  if [ ! -x $binary ]; then
+    echo "$binary is missing, run ./build.sh first"
+    exit 1
+  fi
+done
+
+record=""
+if [ "$1" == "--record" ]; then
+  record=yes
+elif [ ! -f $baseline ]; then
+  echo "No baseline for this host in $baseline yet, this run makes it"
+  record=first
+fi
+
+# Keep the server and the load generator off each other's CPU
+pin_server=""
+pin_loadgen=""
+if [ $(nproc) -ge 2 ] && command -v taskset > /dev/null; then
+  pin_server="taskset -c 0"
+  pin_loadgen="taskset -c 1"
+else
+  echo "Warning: the server and bin/loadgen share a CPU, latencies are noisy"
+fi
+
+# Every connection comes from loopback, so per-address limits are off
+$pin_server bin/server --accept-rate 100000 --exempt-local --rooms $port \
+  > /dev/null &
+server_pid=$!
+trap "kill $server_pid 2> /dev/null" EXIT
+
+# Wait for the server to accept connections
+for attempt in $(seq 100); do
+  if (exec 3<> /dev/tcp/localhost/$port) 2> /dev/null; then
+    break
+  fi
+  if ! kill -0 $server_pid 2> /dev/null || [ $attempt == 100 ]; then
+    echo "The server did not start listening on port $port"
+    exit 1
+  fi
+  sleep 0.05
+done
+
+loadgen_args="localhost $port --rooms $rooms --warmup $warmup \
+--seconds $seconds --runs $runs --server-pid $server_pid --idle $idle"
+
+if [ -n "$record" ]; then
+  mkdir -p perf
+  $pin_loadgen bin/loadgen $loadgen_args > $baseline.tmp
+  mv $baseline.tmp $baseline
+  cat $baseline
+  echo "Baseline recorded in $baseline."
+  if [ "$record" == "first" ]; then
+    echo "Nothing to compare against yet: run ./perf.sh again to check" \
+         "for regressions."
+  fi
+else
+  $pin_loadgen bin/loadgen $loadgen_args --baseline $baseline > /dev/null
+  echo "No regressions."
+fi
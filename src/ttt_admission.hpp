@@ -0,0 +1,275 @@
+#ifndef ttt_admission_hpp
+#define ttt_admission_hpp
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+//----------------------------------------------------------------------
+
+/*
+** Classic token bucket: refills at 'rate' tokens per second
+** and saves up to 'burst' tokens
+*/
+class ttt_token_bucket {
+ public:
+  typedef std::chrono::steady_clock clock;
+
+  ttt_token_bucket(double rate, double burst)
+      : rate_(rate), burst_(burst), tokens_(burst), last_(clock::now()) {}
+
+  /*
+  ** Takes a token if there is one available
+  */
+  bool try_take(clock::time_point now = clock::now()) {
+    refill(now);
+    if (tokens_ < 1.0) {
+      return false;
+    }
+    tokens_ -= 1.0;
+    return true;
+  }
+
+  /*
+  ** Is there a token available? Does not take it.
+  */
+  bool ready(clock::time_point now = clock::now()) {
+    refill(now);
+    return tokens_ >= 1.0;
+  }
+
+  /*
+  ** Has the bucket refilled completely?
+  */
+  bool full(clock::time_point now = clock::now()) {
+    refill(now);
+    return tokens_ >= burst_;
+  }
+
+ private:
+  void refill(clock::time_point now) {
+    std::chrono::duration<double> elapsed = now - last_;
+    last_ = now;
+    tokens_ = std::min(burst_, tokens_ + elapsed.count() * rate_);
+  }
+
+ private:
+  double rate_;
+  double burst_;
+  double tokens_;
+  clock::time_point last_;
+};
+
+//----------------------------------------------------------------------
+
+/*
+** Counts events over fixed windows of time, starting from zero again
+** with every window
+*/
+class ttt_window_counter {
+ public:
+  typedef ttt_token_bucket::clock clock;
+
+  void add(clock::time_point now, clock::duration window) {
+    if (now - start_ >= window) {
+      start_ = now;
+      count_ = 0;
+    }
+    count_ += 1;
+  }
+
+  /*
+  ** Events in the window of the last one
+  */
+  unsigned count() const { return count_; }
+
+ private:
+  clock::time_point start_;
+  unsigned count_ = 0;
+};
+
+//----------------------------------------------------------------------
+
+/*
+** Limits applied to every connection coming from the same address
+*/
+struct ttt_source_limits {
+  ttt_source_limits(double connect_rate, double connect_burst,
+                    double move_rate, double move_burst)
+      : connects(connect_rate, connect_burst),
+        moves(move_rate, move_burst),
+        connections(0) {}
+
+  ttt_token_bucket connects;  // New connections from this address
+  ttt_token_bucket moves;     // Moves of all its connections together
+  unsigned connections;       // Connections currently open
+};
+
+//----------------------------------------------------------------------
+
+/*
+** Tunables of ttt_admission_control. Rates are in events per second.
+*/
+struct ttt_admission_limits {
+  unsigned max_connections = 10000;
+  double accept_rate = 500, accept_burst = 1000;  // Whole process
+  unsigned max_source_connections = 64;           // Per address
+  double source_connect_rate = 5, source_connect_burst = 20;
+  double source_move_rate = 200, source_move_burst = 400;
+  double move_rate = 10, move_burst = 20;  // Per connection
+  unsigned max_refused_frames = 32;  // In a window, then it is dropped
+  std::chrono::seconds refused_frames_window = std::chrono::seconds(10);
+  bool exempt_local = false;  // Loopback and local socket peers go unlimited
+};
+
+//----------------------------------------------------------------------
+
+/*
+** Decides which connections and frames the server is willing to handle.
+** It is shared by every server of the process, so the connection cap
+** and the accept rate are global.
+*/
+class ttt_admission_control {
+ public:
+  explicit ttt_admission_control(
+      const ttt_admission_limits& limits = ttt_admission_limits())
+      : limits_(limits), accepts_(limits.accept_rate, limits.accept_burst) {}
+
+  const ttt_admission_limits& limits() const { return limits_; }
+
+  unsigned connections() const { return connections_; }
+
+  /*
+  ** Decides whether a freshly accepted connection from 'address' is kept.
+  ** On success, 'source' gets the shared limits of that address (left
+  ** empty if the address is empty, i.e. unknown or exempt) and the
+  ** connection must later be handed back through 'release'.
+  **
+  ** The global accept token is only spent on connections that pass the
+  ** limits of their address, so one address going over them does not
+  ** starve the others.
+  */
+  bool admit(const std::string& address,
+             std::shared_ptr<ttt_source_limits>& source) {
+    auto now = ttt_token_bucket::clock::now();
+
+    if (connections_ >= limits_.max_connections || !accepts_.ready(now)) {
+      return false;
+    }
+
+    std::shared_ptr<ttt_source_limits> entry;
+    if (!address.empty()) {
+      if (++admits_since_sweep_ >= sweep_interval) {
+        sweep(now);
+      }
+
+      auto& known = sources_[address];
+      if (!known) {
+        known = std::make_shared<ttt_source_limits>(
+            limits_.source_connect_rate, limits_.source_connect_burst,
+            limits_.source_move_rate, limits_.source_move_burst);
+      }
+      entry = known;
+
+      if (entry->connections >= limits_.max_source_connections ||
+          !entry->connects.try_take(now)) {
+        return false;
+      }
+      entry->connections += 1;
+    }
+
+    accepts_.try_take(now);  // Known to be there
+    connections_ += 1;
+    source = std::move(entry);
+    return true;
+  }
+
+  /*
+  ** Hands back a connection previously admitted
+  */
+  void release(ttt_source_limits* source) {
+    connections_ -= 1;
+    if (source) {
+      source->connections -= 1;
+    }
+  }
+
+  /*
+  ** Builds the token bucket a single connection spends on its moves
+  */
+  ttt_token_bucket make_move_bucket() const {
+    return ttt_token_bucket(limits_.move_rate, limits_.move_burst);
+  }
+
+ private:
+  enum { sweep_interval = 1024 };
+
+  /*
+  ** Forgets addresses with no open connections whose buckets refilled,
+  ** as keeping them would not limit anything
+  */
+  void sweep(ttt_token_bucket::clock::time_point now) {
+    admits_since_sweep_ = 0;
+    for (auto it = sources_.begin(); it != sources_.end();) {
+      ttt_source_limits& s = *it->second;
+      if (s.connections == 0 && s.connects.full(now) && s.moves.full(now)) {
+        it = sources_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+ private:
+  ttt_admission_limits limits_;
+  ttt_token_bucket accepts_;
+  unsigned connections_ = 0;
+  unsigned admits_since_sweep_ = 0;
+  std::unordered_map<std::string, std::shared_ptr<ttt_source_limits>>
+      sources_;
+};
+
+//----------------------------------------------------------------------
+
+/*
+** Proof that a connection was admitted. The connection is handed back
+** to the admission control when the ticket is destroyed.
+*/
+class ttt_admission_ticket {
+ public:
+  ttt_admission_ticket(ttt_admission_control& admission,
+                       std::shared_ptr<ttt_source_limits> source)
+      : admission_(&admission), source_(std::move(source)) {}
+
+  ttt_admission_ticket(ttt_admission_ticket&& other)
+      : admission_(other.admission_), source_(std::move(other.source_)) {
+    other.admission_ = nullptr;
+  }
+
+  ttt_admission_ticket(const ttt_admission_ticket&) = delete;
+  ttt_admission_ticket& operator=(const ttt_admission_ticket&) = delete;
+
+  ~ttt_admission_ticket() {
+    if (admission_) {
+      admission_->release(source_.get());
+    }
+  }
+
+  ttt_admission_control& admission() const { return *admission_; }
+
+  /*
+  ** Limits shared with the other connections of the same address,
+  ** or null if the address is unknown
+  */
+  ttt_source_limits* source() const { return source_.get(); }
+
+ private:
+  ttt_admission_control* admission_;
+  std::shared_ptr<ttt_source_limits> source_;
+};
+
+//----------------------------------------------------------------------
+
+#endif  // ttt_admission_hpp
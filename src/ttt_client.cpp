@@ -1,162 +1,37 @@
 #include <cstdlib>
 #include <cstring>
-#include <deque>
 #include <iostream>
+#include <map>
 #include <string>
 #include <sstream>
 #include <utility>
 #include <vector>
 #include <boost/asio.hpp>
-#include <boost/thread.hpp>
-#include <boost/algorithm/string.hpp>
+#include <unistd.h>
 #include "ttt_shared.hpp"
+#include "ttt_client_session.hpp"
+#include "ttt_lobby.hpp"
+#include "ttt_renderer.hpp"
 
 using boost::asio::ip::tcp;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+using boost::asio::local::stream_protocol;
+#endif
 
 //------------------------------------------------------------------------------
 
-class ttt_client_base {
+template <typename Protocol>
+class ttt_client : public ttt_client_base<Protocol> {
  public:
-  ttt_client_base(boost::asio::io_service& io_service,
-                  tcp::resolver::iterator endpoint_iterator)
-      : io_service_(io_service), socket_(io_service) {
-    do_connect(endpoint_iterator);
-  }
-
-  void close() {
-    static bool got_here = false;
-    if (got_here) {
-      return;
-    }
-    got_here = true;
-
-    socket_.shutdown(tcp::socket::shutdown_both);
-    socket_.close();
-
-    log("Disconnected from the server");
-    on_server_disconnection();
-  }
-
- protected:
-  virtual void on_server_connection() {}
-
-  virtual void on_message_received(const ttt_message& msg) {}
-
-  virtual void on_message_sent(const ttt_message& msg) {}
-
-  virtual void on_server_disconnection() {}
-
-  virtual void log(const std::string& msg) const {
-    std::string buffer = "tic_tac_toe_client '" + msg + "'\n";
-    std::cout << buffer;
-  }
-
-  void write(const ttt_message& msg) {
-    io_service_.post([this, msg]() {
-      bool write_in_progress = !write_msgs_.empty();
-      write_msgs_.push_back(msg);
-      if (!write_in_progress) {
-        do_write();
-      }
-    });
-  }
-
- private:
-  void do_connect(tcp::resolver::iterator endpoint_iterator) {
-    boost::asio::async_connect(
-        socket_, endpoint_iterator,
-        [this](boost::system::error_code ec, tcp::resolver::iterator) {
-          if (!ec) {
-            log("Connected to the server");
-            on_server_connection();
-
-            do_read_header();
-          } else {
-            log("Could not connect to the server");
-          }
-        });
-  }
-
-  void do_read_header() {
-    boost::asio::async_read(
-        socket_,
-        boost::asio::buffer(read_msg_.data(), ttt_message::header_length),
-        [this](boost::system::error_code ec, std::size_t /*length*/) {
-          if (!ec && read_msg_.decode_header()) {
-            do_read_body();
-          } else {
-            log("An error occurred while listening to the server");
-            this->close();
-          }
-        });
-  }
-
-  void do_read_body() {
-    boost::asio::async_read(
-        socket_, boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
-        [this](boost::system::error_code ec, std::size_t /*length*/) {
-          if (!ec) {
-            log("Received server message");
-            on_message_received(read_msg_);
-
-            do_read_header();
-          } else {
-            log("An error occurred while listening to the server");
-            this->close();
-          }
-        });
-  }
-
-  void do_write() {
-    log("Sending message...");
-    boost::asio::async_write(
-        socket_, boost::asio::buffer(write_msgs_.front().data(),
-                                     write_msgs_.front().length()),
-        [this](boost::system::error_code ec, std::size_t /*length*/) {
-          if (!ec) {
-            log("A message was sent");
-            on_message_sent(write_msgs_.front());
-
-            write_msgs_.pop_front();
+  typedef typename Protocol::endpoint endpoint_type;
 
-            if (!write_msgs_.empty()) {
-              do_write();
-            }
-          } else {
-            log("An error occurred while writing to the server");
-            this->close();
-          }
-        });
-  }
-
- private:
-  boost::asio::io_service& io_service_;
-  tcp::socket socket_;
-  ttt_message read_msg_;
-  ttt_message_queue write_msgs_;
-};
-
-//------------------------------------------------------------------------------
-
-class ttt_client : public ttt_client_base {
- public:
   ttt_client(boost::asio::io_service& io_service,
-             tcp::resolver::iterator endpoint_iterator)
-      : ttt_client_base(io_service, endpoint_iterator) {}
-
-  void take(int x, int y) {
-    std::stringstream ss;
-    ss << x << ", " << y;
-
-    std::string msg_body = ss.str();
-
-    ttt_message msg;
-    memcpy(msg.body(), msg_body.c_str(), msg_body.size());
-    msg.body_length(msg_body.size());
-    msg.encode_header();
-
-    write(msg);
-  }
+             const std::vector<endpoint_type>& endpoints,
+             const ttt_join_message& join)
+      : ttt_client_base<Protocol>(io_service, endpoints, join),
+        spectating_(join.spectate),
+        input_(io_service, ::dup(STDIN_FILENO)),
+        renderer_(std::cout, ::isatty(STDOUT_FILENO)) {}
 
  protected:
   void on_server_connection() override {
@@ -164,22 +39,9 @@ class ttt_client : public ttt_client_base {
 
     last_umsg_.playing = true;
 
-    boost::thread input_t([this]() {
-      while (this->last_umsg_.playing) {  // While the game is running...
-        std::string token;
-        std::cin >> token;
-
-        int value;
-        bool got_int = (std::sscanf(token.c_str(), "%d", &value) == 1);
-
-        if (got_int && 1 <= value && value <= 9) {
-          auto mapped_res = this->numpad_to_cell(value);
-          this->take(mapped_res.first, mapped_res.second);
-        }
-      }
-    });
-
-    input_t.detach();
+    if (!spectating_) {
+      do_read_input();
+    }
   }
 
   void on_message_received(const ttt_message& msg) override {
@@ -189,8 +51,7 @@ class ttt_client : public ttt_client_base {
       return;
     }
 
-    std::cout << '\n';
-    draw_game(umsg);
+    renderer_.draw(umsg);
 
     last_umsg_ = umsg;
   }
@@ -198,6 +59,9 @@ class ttt_client : public ttt_client_base {
   void on_server_disconnection() override {
     last_umsg_.playing = false;
 
+    boost::system::error_code ignored_ec;
+    input_.cancel(ignored_ec);  // Nothing else to wait for
+
     std::cout << "Client session finished.\n";
   }
 
@@ -206,166 +70,236 @@ class ttt_client : public ttt_client_base {
 
  private:
   /*
-  ** Draws a representation of a TTT game from an TTT Update Message
+  ** Reads the player's input, a line at a time, on the io_service thread
   */
-  void draw_game(const ttt_update_message& umsg) {
-    // Players naming
-    std::string player_name[ttt_number_of_players];
-    for (int i = 0; i < ttt_number_of_players; i++) {
-      player_name[i] = (i == (int)umsg.player_id ? "you" : "your opponent");
-    }
+  void do_read_input() {
+    auto self(this->shared_from_this());
+    boost::asio::async_read_until(
+        input_, input_buf_, '\n',
+        [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+          if (ec) {
+            return;  // End of input, or the session is over
+          }
 
-    // Game title
-    // std::cout << enclose_text("TIC TAC TOE") << '\n';
+          std::istream is(&input_buf_);
+          std::string line;
+          std::getline(is, line);
 
-    // Game board
-    const std::string board = draw_board_str(umsg);
+          std::istringstream tokens(line);
+          std::string token;
+          while (last_umsg_.playing && tokens >> token) {
+            int value;
+            bool got_int = (std::sscanf(token.c_str(), "%d", &value) == 1);
 
-    // How to play
-    std::string instructions = "";
-    if (umsg.playing) {
-      instructions +=
-          "HOW TO PLAY\n"
-          "Type a digit from your numeric pad (numpad) to choose a cell.\n"
-          "Digits correspond to cells so that the game board resembles your "
-          "numpad.\n";
-    }
+            if (got_int && 1 <= value && value <= 9) {
+              auto mapped_res = numpad_to_cell(value);
+              this->take(mapped_res.first, mapped_res.second);
+            }
+          }
 
-    // Game status information
-    std::string status = "";
-    if (umsg.playing) {
-      status +=
-          "Waiting for " + player_name[(int)umsg.current_player] + " to move";
-    } else if (umsg.winner == ttt_player_id::none) {
-      status += "GAME OVER, you tied!";
-    } else {
-      status += "GAME OVER, you ";
-      status += (umsg.winner == umsg.player_id ? "won!" : "lost!");
-    }
-    status += "\n";
+          if (last_umsg_.playing) {  // While the game is running...
+            do_read_input();
+          }
+        });
+  }
 
-    // Draw it!
-    std::cout << board << '\n';
-    std::cout << instructions << '\n';
-    std::cout << status << '\n';
+  std::pair<int, int> numpad_to_cell(int i) {
+    static const std::vector<std::pair<int, int>> data {
+      {9, 9},
+      {2, 0}, {2, 1}, {2, 2},
+      {1, 0}, {1, 1}, {1, 2},
+      {0, 0}, {0, 1}, {0, 2}
+    };
+    return data[i];
   }
 
-  /*
-  ** 'Encloses' a given text around a box,
-  ** whose edges are drawn with a given char
-  */
-  std::string enclose_text(const std::string str, char fill_char = '*') {
-    std::deque<std::string> content;
-    boost::split(content, str, boost::is_any_of("\n"));
+ private:
+  bool spectating_;  // Only watching, so there is no input to read
+  boost::asio::posix::stream_descriptor input_;  // Player's standard input
+  boost::asio::streambuf input_buf_;
+  ttt_terminal_renderer renderer_;
+  ttt_update_message last_umsg_;
+};
 
-    unsigned max_len = 0;
-    for (auto line : content) {
-      max_len = std::max((unsigned)line.size(), max_len);
-    }
+//------------------------------------------------------------------------------
 
-    std::string separator(max_len + 4, fill_char);
+/*
+** Follows the lobby of a room server. On terminals, it keeps a table of
+** the rooms on screen; otherwise it prints every change as it comes.
+*/
+template <typename Protocol>
+class ttt_lobby_client : public ttt_client_base<Protocol> {
+ public:
+  typedef typename Protocol::endpoint endpoint_type;
+
+  enum { max_rows = 40 };  // Rooms shown on the table
+
+  ttt_lobby_client(boost::asio::io_service& io_service,
+                   const std::vector<endpoint_type>& endpoints)
+      : ttt_client_base<Protocol>(io_service, endpoints),
+        ansi_(::isatty(STDOUT_FILENO)) {}
+
+ protected:
+  void on_server_connection() override {
+    this->write(ttt_lobby_subscribe_message(epoch_, version_).to_message());
+  }
 
-    if (content.front() != "") {
-      content.push_front("");
+  void on_message_received(const ttt_message& msg) override {
+    ttt_lobby_message lmsg;
+    if (!ttt_lobby_message::try_parse(msg, lmsg)) {
+      return;
     }
-    if (content.back() != "") {
-      content.push_back("");
+    epoch_ = lmsg.epoch;
+    version_ = lmsg.version;
+
+    switch (lmsg.event) {
+      case ttt_lobby_event::reset:
+        rooms_.clear();
+        synced_ = false;
+        break;
+      case ttt_lobby_event::add:
+      case ttt_lobby_event::update: {
+        ttt_room_info& info = rooms_[lmsg.room];
+        info.players = lmsg.players;
+        info.spectators = lmsg.spectators;
+        info.playing = lmsg.playing;
+        break;
+      }
+      case ttt_lobby_event::remove:
+        rooms_.erase(lmsg.room);
+        break;
+      case ttt_lobby_event::synced:
+        synced_ = true;
+        break;
     }
 
-    std::stringstream result;
-
-    result << separator << '\n';
-    for (std::string line : content) {
-      line = line + std::string(max_len - line.size(), ' ');
-      result << fill_char << ' ' << line << ' ' << fill_char << '\n';
+    if (!ansi_) {
+      std::cout << lmsg.to_string() << std::endl;
+    } else if (synced_) {
+      draw();
     }
-    result << separator << '\n';
+  }
 
-    return result.str();
+  void on_server_disconnection() override {
+    std::cout << "Lobby session finished.\n";
   }
 
-  /*
-  ** Returns a text representation of the board inside a TTT Update Message
-  */
-  std::string draw_board_str(const ttt_update_message& umsg) {
-    std::string board = empty_board;
-
-    for (unsigned i = 0; i < ttt_board_side; i++) {
-      for (unsigned j = 0; j < ttt_board_side; j++) {
-        // Skip drawing if no player owns the spot
-        if (umsg.board[i][j] == ttt_player_id::none) {
-          continue;
-        }
-
-        // Get player's corresponding letter
-        std::string letter = (umsg.board[i][j] == umsg.player_id ? X : O);
-
-        // Draw it!
-        const int x = 8 * i, y = 8 * j;
-        for (unsigned a = 0, b = 0; a < letter.size(); a++) {
-          if (letter[a] == '\n') {
-            b += 1;
-            continue;
-          }
+  void log(const std::string& msg) const {}
 
-          const int row = x + b, col = y + (a % 8);
-          board[row * 24 + col] = letter[a];
-        }
+ private:
+  void draw() const {
+    std::ostringstream os;
+    os << "\x1b[H\x1b[2J"
+       << "ROOMS (" << rooms_.size() << ", version " << version_ << ")\n\n";
+
+    unsigned rows = 0;
+    for (const auto& room : rooms_) {
+      if (rows++ == max_rows) {
+        os << "... and " << rooms_.size() - max_rows << " more\n";
+        break;
       }
+      os << "  " << room.first << "  " << room.second.players << "/"
+         << ttt_number_of_players << " players, " << room.second.spectators
+         << " watching, " << (room.second.playing ? "playing" : "open")
+         << "\n";
     }
 
-    return board;
-  }
-  
-  std::pair<int, int> numpad_to_cell(int i) {
-    static const std::vector<std::pair<int, int>> data {
-      {9, 9},
-      {2, 0}, {2, 1}, {2, 2},
-      {1, 0}, {1, 1}, {1, 2},
-      {0, 0}, {0, 1}, {0, 2}
-    };
-    return data[i];
+    std::cout << os.str() << std::flush;
   }
 
  private:
-  ttt_update_message last_umsg_;
-  const std::string X =
-      "       \n \\   / \n  \\ /  \n   x   \n  / \\  \n /   \\ \n       \n";
-  const std::string O =
-      "   _   \n  / \\  \n |   | \n |   | \n |   | \n  \\_/  \n       \n";
-  const std::string empty_board =
-      "       |       |       \n       |       |       \n       |       |    "
-      "   \n       |       |       \n       |       |       \n       |       "
-      "|       \n       |       |       \n-----------------------\n       |  "
-      "     |       \n       |       |       \n       |       |       \n     "
-      "  |       |       \n       |       |       \n       |       |       "
-      "\n       |       |       \n-----------------------\n       |       |  "
-      "     \n       |       |       \n       |       |       \n       |     "
-      "  |       \n       |       |       \n       |       |       \n       "
-      "|       |       \n";
+  bool ansi_;
+  bool synced_ = false;
+  uint64_t epoch_ = 0;  // Of the server run 'version_' comes from
+  uint64_t version_ = 0;
+  std::map<std::string, ttt_room_info> rooms_;
 };
 
 //------------------------------------------------------------------------------
 
+/*
+** Runs a client session until the server connection is over
+*/
+template <typename Protocol>
+void run_client(boost::asio::io_service& io_service,
+                const std::vector<typename Protocol::endpoint>& endpoints,
+                const ttt_join_message& join, bool lobby) {
+  if (lobby) {
+    ttt_start_session<ttt_lobby_client<Protocol>>(io_service, endpoints);
+  } else {
+    ttt_start_session<ttt_client<Protocol>>(io_service, endpoints, join);
+  }
+
+  io_service.run();
+}
+
+//------------------------------------------------------------------------------
+
 int main(int argc, char* argv[]) {
   try {
-    if (argc != 3) {
-      std::cerr << "Usage: client <host> <port>\n";
+    const bool local = (argc >= 2 && std::strncmp(argv[1], "unix:", 5) == 0);
+    const int room_arg = (local ? 2 : 3);
+
+    // What to do there: play (the default), spectate or follow the lobby
+    std::vector<std::string> args;
+    if (argc >= room_arg) {
+      args.assign(argv + room_arg, argv + argc);
+    }
+    const bool lobby = (args.size() == 1 && args[0] == "--lobby");
+    const bool spectate = (args.size() == 2 && args[0] == "--spectate");
+    const bool play = (args.size() <= 2 &&
+                       (args.empty() || args[0].compare(0, 2, "--") != 0));
+
+    if (argc < room_arg || !(play || lobby || spectate)) {
+      std::cerr << "Usage: client <host> <port> [<room> [<player>]]\n"
+                   "       client <host> <port> --spectate <room>\n"
+                   "       client <host> <port> --lobby\n"
+                   "       client unix:<path> ...\n";
       return 1;
     }
 
-    boost::asio::io_service io_service;
-
-    tcp::resolver resolver(io_service);
-    auto endpoint_iterator = resolver.resolve({argv[1], argv[2]});
-    ttt_client c(io_service, endpoint_iterator);
+    ttt_join_message join;
+    join.spectate = spectate;
+    if (spectate) {
+      join.room = args[1];
+    } else if (!lobby) {
+      if (args.size() > 0) {
+        join.room = args[0];
+      }
+      if (args.size() > 1) {
+        join.player = args[1];
+      }
+    }
+    const bool valid_room =
+        join.room.empty() || ttt_join_message::valid_room(join.room);
+    const bool valid_player =
+        join.player.empty() || ttt_join_message::valid_player(join.player);
+    if (!valid_room || !valid_player) {
+      std::cerr << "Rooms and players are named with letters, digits, "
+                   "'-' and '_'\n";
+      return 1;
+    }
 
-    boost::thread client_t([&io_service]() { io_service.run(); });
+    boost::asio::io_service io_service;
 
-    client_t.join();
+    if (local) {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+      std::vector<stream_protocol::endpoint> endpoints{
+          stream_protocol::endpoint(argv[1] + 5)};
+      run_client<stream_protocol>(io_service, endpoints, join, lobby);
+#else
+      std::cerr << "Unix domain sockets are not supported here\n";
+      return 1;
+#endif
+    } else {
+      tcp::resolver resolver(io_service);
+      tcp::resolver::iterator it = resolver.resolve({argv[1], argv[2]}), end;
+      std::vector<tcp::endpoint> endpoints(it, end);
+      run_client<tcp>(io_service, endpoints, join, lobby);
+    }
   } catch (std::exception& e) {
     std::cerr << "Exception: " << e.what() << "\n";
   }
 
   return 0;
-}
\ No newline at end of file
+}
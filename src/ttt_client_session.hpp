@@ -0,0 +1,317 @@
+#ifndef ttt_client_session_hpp
+#define ttt_client_session_hpp
+
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include "ttt_shared.hpp"
+
+//------------------------------------------------------------------------------
+
+/*
+** Finds where a redirect message points to. Only TCP sessions can be
+** redirected, as other transports do not reach other hosts.
+*/
+template <typename Protocol>
+class ttt_redirect_resolver {
+ public:
+  typedef typename Protocol::endpoint endpoint_type;
+  typedef std::function<void(bool, const std::vector<endpoint_type>&)> handler;
+
+  explicit ttt_redirect_resolver(boost::asio::io_service& /*io_service*/) {}
+
+  void resolve(const ttt_redirect_message& /*rmsg*/, handler h) {
+    h(false, std::vector<endpoint_type>());
+  }
+};
+
+template <>
+class ttt_redirect_resolver<boost::asio::ip::tcp> {
+ public:
+  typedef boost::asio::ip::tcp tcp;
+  typedef std::function<void(bool, const std::vector<tcp::endpoint>&)> handler;
+
+  explicit ttt_redirect_resolver(boost::asio::io_service& io_service)
+      : resolver_(io_service) {}
+
+  void resolve(const ttt_redirect_message& rmsg, handler h) {
+    tcp::resolver::query query(rmsg.host, rmsg.port);
+    resolver_.async_resolve(
+        query, [h](boost::system::error_code ec, tcp::resolver::iterator it) {
+          std::vector<tcp::endpoint> endpoints;
+          if (!ec) {
+            endpoints.assign(it, tcp::resolver::iterator());
+          }
+          h(!endpoints.empty(), endpoints);
+        });
+  }
+
+ private:
+  tcp::resolver resolver_;
+};
+
+//------------------------------------------------------------------------------
+
+/*
+** One connection to a game server. Sessions never block nor spawn
+** threads, so any number of them can share a single io_service.
+** Given a room, the session joins it, following redirects from a
+** cluster front door to the node hosting it.
+**
+** Sessions are owned through shared pointers, and every pending handler
+** holds one: a session may be let go of at any time, and goes away once
+** its last handler has run. Use 'ttt_start_session' to make them.
+*/
+template <typename Protocol>
+class ttt_client_base
+    : public std::enable_shared_from_this<ttt_client_base<Protocol>> {
+ public:
+  typedef typename Protocol::socket socket_type;
+  typedef typename Protocol::endpoint endpoint_type;
+
+  enum { max_redirects = 4 };
+
+  ttt_client_base(boost::asio::io_service& io_service,
+                  const std::vector<endpoint_type>& endpoints,
+                  const ttt_join_message& join = ttt_join_message())
+      : io_service_(io_service),
+        socket_(io_service),
+        endpoints_(endpoints),
+        join_(join),
+        resolver_(io_service) {}
+
+  virtual ~ttt_client_base() {}
+
+  /*
+  ** Connects to the server. Handlers need the session to be shared
+  ** already, so this can't be done by the constructor.
+  */
+  void start() { do_connect(); }
+
+  /*
+  ** Asks the server to take cell (x, y) for us
+  */
+  void take(int x, int y) { write(ttt_move_message(x, y).to_message()); }
+
+  void close() {
+    if (closed_) {
+      return;
+    }
+    closed_ = true;
+
+    boost::system::error_code ignored_ec;
+    socket_.shutdown(socket_type::shutdown_both, ignored_ec);
+    socket_.close(ignored_ec);
+
+    log("Disconnected from the server");
+    on_server_disconnection();
+  }
+
+ protected:
+  /*
+  ** Called once, when the session first reaches a server
+  */
+  virtual void on_server_connection() {}
+
+  virtual void on_message_received(const ttt_message& msg) {}
+
+  virtual void on_message_sent(const ttt_message& msg) {}
+
+  virtual void on_server_disconnection() {}
+
+  virtual void log(const std::string& msg) const {
+    std::string buffer = "tic_tac_toe_client '" + msg + "'\n";
+    std::cout << buffer;
+  }
+
+  /*
+  ** Queues a message for the server. Like every other member,
+  ** it must be called from the thread running the io_service.
+  */
+  void write(const ttt_message& msg) {
+    bool write_in_progress = !write_msgs_.empty();
+    write_msgs_.push_back(msg);
+    if (!write_in_progress) {
+      do_write();
+    }
+  }
+
+  boost::asio::io_service& io_service() { return io_service_; }
+
+ private:
+  void do_connect() {
+    typedef typename std::vector<endpoint_type>::const_iterator iterator;
+    auto self(this->shared_from_this());
+    const unsigned id = connection_id_;
+    boost::asio::async_connect(
+        socket_, endpoints_.begin(), endpoints_.end(),
+        [this, self, id](boost::system::error_code ec, iterator) {
+          if (id != connection_id_) {
+            return;  // Superseded by a redirect
+          }
+
+          if (!ec) {
+            log("Connected to the server");
+            if (!join_.room.empty()) {
+              write(join_.to_message());
+            }
+            if (!connected_) {
+              connected_ = true;
+              on_server_connection();
+            }
+
+            do_read_header();
+          } else {
+            log("Could not connect to the server");
+            close();
+          }
+        });
+  }
+
+  /*
+  ** Drops the current connection to join our room somewhere else
+  */
+  void follow_redirect(const ttt_redirect_message& rmsg) {
+    if (++redirects_ > max_redirects) {
+      log("Too many redirects");
+      close();
+      return;
+    }
+
+    log("Redirected to " + rmsg.host + ":" + rmsg.port);
+
+    connection_id_ += 1;  // Handlers of the old connection bail out
+    boost::system::error_code ignored_ec;
+    socket_.close(ignored_ec);
+    write_msgs_.clear();
+
+    auto self(this->shared_from_this());
+    const unsigned id = connection_id_;
+    resolver_.resolve(rmsg, [this, self, id](
+                                bool ok,
+                                const std::vector<endpoint_type>& eps) {
+      if (id != connection_id_) {
+        return;
+      }
+      if (!ok) {
+        log("Could not follow the redirect");
+        close();
+        return;
+      }
+      endpoints_ = eps;
+      do_connect();
+    });
+  }
+
+  void do_read_header() {
+    auto self(this->shared_from_this());
+    const unsigned id = connection_id_;
+    boost::asio::async_read(
+        socket_,
+        boost::asio::buffer(read_msg_.data(), ttt_message::header_length),
+        [this, self, id](boost::system::error_code ec, std::size_t /*length*/) {
+          if (id != connection_id_) {
+            return;
+          }
+
+          if (!ec && read_msg_.decode_header()) {
+            do_read_body();
+          } else {
+            log("An error occurred while listening to the server");
+            this->close();
+          }
+        });
+  }
+
+  void do_read_body() {
+    auto self(this->shared_from_this());
+    const unsigned id = connection_id_;
+    boost::asio::async_read(
+        socket_, boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
+        [this, self, id](boost::system::error_code ec, std::size_t /*length*/) {
+          if (id != connection_id_) {
+            return;
+          }
+
+          if (!ec) {
+            log("Received server message");
+
+            ttt_redirect_message rmsg;
+            if (!join_.room.empty() &&
+                ttt_redirect_message::try_parse(read_msg_, rmsg)) {
+              follow_redirect(rmsg);
+              return;
+            }
+
+            on_message_received(read_msg_);
+
+            do_read_header();
+          } else {
+            log("An error occurred while listening to the server");
+            this->close();
+          }
+        });
+  }
+
+  void do_write() {
+    log("Sending message...");
+    auto self(this->shared_from_this());
+    const unsigned id = connection_id_;
+    boost::asio::async_write(
+        socket_, boost::asio::buffer(write_msgs_.front().data(),
+                                     write_msgs_.front().length()),
+        [this, self, id](boost::system::error_code ec, std::size_t /*length*/) {
+          if (id != connection_id_) {
+            return;
+          }
+
+          if (!ec) {
+            log("A message was sent");
+            on_message_sent(write_msgs_.front());
+
+            write_msgs_.pop_front();
+
+            if (!write_msgs_.empty()) {
+              do_write();
+            }
+          } else {
+            log("An error occurred while writing to the server");
+            this->close();
+          }
+        });
+  }
+
+ private:
+  boost::asio::io_service& io_service_;
+  socket_type socket_;
+  std::vector<endpoint_type> endpoints_;
+  ttt_join_message join_;  // Room empty for plain game servers
+  ttt_redirect_resolver<Protocol> resolver_;
+  unsigned connection_id_ = 0;  // Bumped on every redirect
+  unsigned redirects_ = 0;
+  bool connected_ = false;
+  ttt_message read_msg_;
+  ttt_message_queue write_msgs_;
+  bool closed_ = false;
+};
+
+/*
+** Makes a session of type 'Session', derived from ttt_client_base, and
+** starts it
+*/
+template <typename Session, typename... Args>
+std::shared_ptr<Session> ttt_start_session(Args&&... args) {
+  auto session = std::make_shared<Session>(std::forward<Args>(args)...);
+  session->start();
+  return session;
+}
+
+//------------------------------------------------------------------------------
+
+#endif  // ttt_client_session_hpp
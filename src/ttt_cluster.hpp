@@ -0,0 +1,80 @@
+#ifndef ttt_cluster_hpp
+#define ttt_cluster_hpp
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+//----------------------------------------------------------------------
+
+/*
+** 64-bit FNV-1a hash, with a final mix so that similar names
+** ("room1", "room2") land far apart. It is stable across processes
+** and platforms, which std::hash is not guaranteed to be.
+*/
+inline uint64_t ttt_hash(const std::string& text) {
+  uint64_t h = 14695981039346656037ull;
+  for (unsigned char c : text) {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+//----------------------------------------------------------------------
+
+/*
+** Consistent hashing ring mapping room IDs to server nodes. Every node
+** is placed on the ring many times, so rooms spread evenly, and a node
+** joining or leaving only moves the rooms next to its own points.
+*/
+class ttt_hash_ring {
+ public:
+  enum { points_per_node = 128 };
+
+  bool empty() const { return points_.empty(); }
+
+  void add_node(const std::string& node) {
+    for (unsigned i = 0; i < points_per_node; i++) {
+      points_[point(node, i)] = node;
+    }
+  }
+
+  void remove_node(const std::string& node) {
+    for (unsigned i = 0; i < points_per_node; i++) {
+      auto it = points_.find(point(node, i));
+      if (it != points_.end() && it->second == node) {
+        points_.erase(it);
+      }
+    }
+  }
+
+  /*
+  ** Returns the node owning the given room. The ring must not be empty.
+  */
+  const std::string& owner(const std::string& room) const {
+    auto it = points_.lower_bound(ttt_hash(room));
+    if (it == points_.end()) {
+      it = points_.begin();  // Wrap around
+    }
+    return it->second;
+  }
+
+ private:
+  static uint64_t point(const std::string& node, unsigned i) {
+    return ttt_hash(node + "#" + std::to_string(i));
+  }
+
+ private:
+  std::map<uint64_t, std::string> points_;
+};
+
+//----------------------------------------------------------------------
+
+#endif  // ttt_cluster_hpp
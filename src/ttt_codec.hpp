@@ -0,0 +1,284 @@
+#ifndef ttt_codec_hpp
+#define ttt_codec_hpp
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+//----------------------------------------------------------------------
+
+/*
+** Binary message bodies start with the protocol version and a tag
+** telling the type of message; the fields declared in the schema of
+** that type follow. Integers are little endian.
+*/
+enum { ttt_protocol_version = 1 };
+enum { ttt_wire_header_length = 2 };
+
+/*
+** Writes fields straight into a frame. Schemas make sure at compile
+** time that their largest message fits, so it never checks bounds.
+*/
+class ttt_wire_writer {
+ public:
+  explicit ttt_wire_writer(char* out) : begin_(out), p_(out) {}
+
+  void put_byte(uint8_t byte) { *p_++ = char(byte); }
+
+  void put_bytes(const char* data, std::size_t n) {
+    std::memcpy(p_, data, n);
+    p_ += n;
+  }
+
+  std::size_t size() const { return p_ - begin_; }
+
+ private:
+  char* begin_;
+  char* p_;
+};
+
+/*
+** Reads fields straight from a received frame, failing instead of
+** going past its end
+*/
+class ttt_wire_reader {
+ public:
+  ttt_wire_reader(const char* begin, const char* end) : p_(begin), end_(end) {}
+
+  bool get_byte(uint8_t& byte) {
+    if (p_ == end_) {
+      return false;
+    }
+    byte = uint8_t(*p_++);
+    return true;
+  }
+
+  /*
+  ** Points 'data' at the next 'n' bytes, without copying them
+  */
+  bool get_bytes(const char*& data, std::size_t n) {
+    if (std::size_t(end_ - p_) < n) {
+      return false;
+    }
+    data = p_;
+    p_ += n;
+    return true;
+  }
+
+  bool done() const { return p_ == end_; }
+
+ private:
+  const char* p_;
+  const char* end_;
+};
+
+//----------------------------------------------------------------------
+
+/*
+** How a field type goes on the wire: 'encode', 'decode' and the
+** 'max_size' it may take. Specialize it for new field types.
+*/
+template <typename T>
+struct ttt_codec;
+
+template <typename T, std::size_t Bytes = sizeof(T)>
+struct ttt_integer_codec {
+  static constexpr std::size_t max_size() { return Bytes; }
+
+  static void encode(ttt_wire_writer& w, T v) {
+    const uint64_t bits = uint64_t(v);
+    for (std::size_t i = 0; i < Bytes; i++) {
+      w.put_byte(uint8_t(bits >> (8 * i)));
+    }
+  }
+
+  static bool decode(ttt_wire_reader& r, T& v) {
+    uint64_t bits = 0;
+    for (std::size_t i = 0; i < Bytes; i++) {
+      uint8_t byte;
+      if (!r.get_byte(byte)) {
+        return false;
+      }
+      bits |= uint64_t(byte) << (8 * i);
+    }
+    v = T(bits);
+    return true;
+  }
+};
+
+template <>
+struct ttt_codec<uint8_t> : ttt_integer_codec<uint8_t> {};
+template <>
+struct ttt_codec<int32_t> : ttt_integer_codec<int32_t> {};
+template <>
+struct ttt_codec<uint64_t> : ttt_integer_codec<uint64_t> {};
+
+template <>
+struct ttt_codec<bool> {
+  static constexpr std::size_t max_size() { return 1; }
+
+  static void encode(ttt_wire_writer& w, bool v) { w.put_byte(v ? 1 : 0); }
+
+  static bool decode(ttt_wire_reader& r, bool& v) {
+    uint8_t byte;
+    if (!r.get_byte(byte) || byte > 1) {
+      return false;
+    }
+    v = (byte == 1);
+    return true;
+  }
+};
+
+/*
+** Enumerations go in a byte; values above 'Last' are rejected
+*/
+template <typename E, E Last>
+struct ttt_enum_codec {
+  static constexpr std::size_t max_size() { return 1; }
+
+  static void encode(ttt_wire_writer& w, E v) { w.put_byte(uint8_t(v)); }
+
+  static bool decode(ttt_wire_reader& r, E& v) {
+    uint8_t byte;
+    if (!r.get_byte(byte) || byte > uint8_t(Last)) {
+      return false;
+    }
+    v = E(byte);
+    return true;
+  }
+};
+
+/*
+** Fixed-size arrays go element after element, with no length
+*/
+template <typename T, std::size_t N>
+struct ttt_codec<std::array<T, N>> {
+  static constexpr std::size_t max_size() {
+    return N * ttt_codec<T>::max_size();
+  }
+
+  static void encode(ttt_wire_writer& w, const std::array<T, N>& v) {
+    for (const T& element : v) {
+      ttt_codec<T>::encode(w, element);
+    }
+  }
+
+  static bool decode(ttt_wire_reader& r, std::array<T, N>& v) {
+    for (T& element : v) {
+      if (!ttt_codec<T>::decode(r, element)) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+//----------------------------------------------------------------------
+
+/*
+** A member of 'Message' in its schema. Use TTT_FIELD to declare one.
+*/
+template <typename Message, typename T, T Message::*Member>
+struct ttt_field {
+  static constexpr std::size_t max_size() { return ttt_codec<T>::max_size(); }
+
+  static void encode(ttt_wire_writer& w, const Message& m) {
+    ttt_codec<T>::encode(w, m.*Member);
+  }
+
+  static bool decode(ttt_wire_reader& r, Message& m) {
+    return ttt_codec<T>::decode(r, m.*Member);
+  }
+};
+
+/*
+** A string member of at most 'MaxLength' bytes, after its length in a
+** byte. Longer strings are cut when encoding and rejected when decoding.
+*/
+template <typename Message, std::string Message::*Member,
+          std::size_t MaxLength>
+struct ttt_string_field {
+  static_assert(MaxLength <= 255, "String lengths must fit in a byte");
+
+  static constexpr std::size_t max_size() { return 1 + MaxLength; }
+
+  static void encode(ttt_wire_writer& w, const Message& m) {
+    const std::string& s = m.*Member;
+    const std::size_t length = (s.size() < MaxLength ? s.size() : MaxLength);
+    w.put_byte(uint8_t(length));
+    w.put_bytes(s.data(), length);
+  }
+
+  static bool decode(ttt_wire_reader& r, Message& m) {
+    uint8_t length;
+    const char* data;
+    if (!r.get_byte(length) || length > MaxLength ||
+        !r.get_bytes(data, length)) {
+      return false;
+    }
+    (m.*Member).assign(data, length);
+    return true;
+  }
+};
+
+#define TTT_FIELD(Message, member) \
+  ttt_field<Message, decltype(Message::member), &Message::member>
+
+#define TTT_STRING_FIELD(Message, member, max_length) \
+  ttt_string_field<Message, &Message::member, max_length>
+
+//----------------------------------------------------------------------
+
+/*
+** The wire format of a message type: its tag and its fields, in order.
+** Encoding and decoding are generated from it at compile time; there is
+** no per-field lookup or reflection at run time.
+*/
+template <uint8_t Tag, typename... Fields>
+struct ttt_schema;
+
+template <uint8_t Tag>
+struct ttt_schema<Tag> {
+  static constexpr uint8_t tag() { return Tag; }
+
+  static constexpr std::size_t max_size() { return ttt_wire_header_length; }
+
+  template <typename Message>
+  static void encode_fields(ttt_wire_writer&, const Message&) {}
+
+  template <typename Message>
+  static bool decode_fields(ttt_wire_reader&, Message&) {
+    return true;
+  }
+};
+
+template <uint8_t Tag, typename Field, typename... Rest>
+struct ttt_schema<Tag, Field, Rest...> {
+  typedef ttt_schema<Tag, Rest...> rest;
+
+  static constexpr uint8_t tag() { return Tag; }
+
+  /*
+  ** Bytes taken by the largest message of this type, header included
+  */
+  static constexpr std::size_t max_size() {
+    return Field::max_size() + rest::max_size();
+  }
+
+  template <typename Message>
+  static void encode_fields(ttt_wire_writer& w, const Message& m) {
+    Field::encode(w, m);
+    rest::encode_fields(w, m);
+  }
+
+  template <typename Message>
+  static bool decode_fields(ttt_wire_reader& r, Message& m) {
+    return Field::decode(r, m) && rest::decode_fields(r, m);
+  }
+};
+
+//----------------------------------------------------------------------
+
+#endif  // ttt_codec_hpp
@@ -0,0 +1,192 @@
+#ifndef ttt_game_state_hpp
+#define ttt_game_state_hpp
+
+#include <cstdint>
+#include <type_traits>
+
+#include "ttt_shared.hpp"
+
+//----------------------------------------------------------------------
+
+enum { ttt_number_of_cells = ttt_board_side * ttt_board_side };
+enum { ttt_no_seat = -1 };
+
+enum class ttt_move_result {
+  accepted,
+  not_playing,
+  invalid_seat,
+  not_your_turn,
+  invalid_cell,
+  cell_taken
+};
+
+/*
+** Line completed by the winner of a game
+*/
+enum class ttt_line : uint8_t { none, row, column, diagonal, anti_diagonal };
+
+/*
+** Returns the player that is not the given one
+*/
+inline ttt_player_id ttt_opponent(ttt_player_id pid) {
+  return (pid == ttt_player_id::player_1 ? ttt_player_id::player_2
+                                         : ttt_player_id::player_1);
+}
+
+//----------------------------------------------------------------------
+
+/*
+** The rules of a single game and nothing else: no players, no sockets,
+** no logging. Seats are plain integer indexes, so seat N plays as
+** ttt_player_id N. It owns no resources and can be copied freely.
+*/
+class ttt_game_state {
+ public:
+  ttt_game_state() { clear_board(); }
+
+  /*
+  ** Is there a game running?
+  */
+  bool playing() const { return playing_; }
+
+  ttt_player_id current_player() const { return current_player_; }
+
+  ttt_player_id winner() const { return winner_; }
+
+  const ttt_board& board() const { return board_; }
+
+  unsigned moves() const { return n_moves_; }
+
+  /*
+  ** Cell taken on move 'i', as 'x * ttt_board_side + y'
+  */
+  unsigned cell_at(unsigned i) const { return cells_[i]; }
+
+  /*
+  ** Line the winner completed, if any
+  */
+  ttt_line line() const { return line_; }
+
+  /*
+  ** Starts a new game with an empty board. Player 1 moves first.
+  */
+  void start() {
+    clear_board();
+    current_player_ = ttt_player_id::player_1;
+    winner_ = ttt_player_id::none;
+    line_ = ttt_line::none;
+    n_moves_ = 0;
+    playing_ = true;
+  }
+
+  /*
+  ** Try to make a move with the player sitting on 'seat'.
+  ** The state is only modified if the move is accepted.
+  */
+  ttt_move_result try_move(int seat, int x, int y) {
+    ttt_move_result result = check_move(seat, x, y);
+    if (result == ttt_move_result::accepted) {
+      play(x, y);
+    }
+    return result;
+  }
+
+  /*
+  ** Would the rules let the player sitting on 'seat' take (x, y)?
+  */
+  ttt_move_result check_move(int seat, int x, int y) const {
+    if (!playing_) {
+      return ttt_move_result::not_playing;
+    }
+
+    if (seat < 0 || seat >= ttt_number_of_players) {
+      return ttt_move_result::invalid_seat;
+    }
+
+    if (seat != (int)current_player_) {
+      return ttt_move_result::not_your_turn;
+    }
+
+    if (x < 0 || x >= ttt_board_side || y < 0 || y >= ttt_board_side) {
+      return ttt_move_result::invalid_cell;
+    }
+
+    if (board_[x][y] != ttt_player_id::none) {
+      return ttt_move_result::cell_taken;
+    }
+
+    return ttt_move_result::accepted;
+  }
+
+  /*
+  ** Takes (x, y) for the current player, which 'check_move' accepted,
+  ** and looks for the end of the game
+  */
+  void play(int x, int y) {
+    board_[x][y] = current_player_;
+    cells_[n_moves_] = x * ttt_board_side + y;
+    n_moves_ += 1;
+    update_game_state(x, y);
+
+    if (playing_) {
+      current_player_ = ttt_opponent(current_player_);  // Next turn
+    }
+  }
+
+ private:
+  /*
+  ** Checks if the move on (x, y) met the ending conditions,
+  ** and updates the game state correspondingly. Only the lines
+  ** going through that cell can have been completed.
+  */
+  void update_game_state(int x, int y) {
+    ttt_player_id line = ttt_player_on(board_, x, 0, 0, 1);
+    line_ = ttt_line::row;
+    if (line == ttt_player_id::none) {
+      line = ttt_player_on(board_, 0, y, 1, 0);
+      line_ = ttt_line::column;
+    }
+    if (line == ttt_player_id::none && x == y) {
+      line = ttt_player_on(board_, 0, 0, 1, 1);
+      line_ = ttt_line::diagonal;
+    }
+    if (line == ttt_player_id::none && x + y == ttt_board_side - 1) {
+      line = ttt_player_on(board_, 0, ttt_board_side - 1, 1, -1);
+      line_ = ttt_line::anti_diagonal;
+    }
+
+    if (line != ttt_player_id::none) {
+      winner_ = line;
+      playing_ = false;
+      return;
+    }
+
+    line_ = ttt_line::none;
+    if (n_moves_ == ttt_number_of_cells) {
+      winner_ = ttt_player_id::none;  // Players tied
+      playing_ = false;
+    }
+  }
+
+  void clear_board() {
+    for (auto& row : board_) {
+      row.fill(ttt_player_id::none);
+    }
+  }
+
+ private:
+  bool playing_ = false;
+  ttt_player_id current_player_ = ttt_player_id::player_1;
+  ttt_player_id winner_ = ttt_player_id::none;
+  ttt_line line_ = ttt_line::none;
+  uint8_t n_moves_ = 0;
+  uint8_t cells_[ttt_number_of_cells];  // Taken on each move, in order
+  ttt_board board_;
+};
+
+static_assert(std::is_trivially_copyable<ttt_game_state>::value,
+              "ttt_game_state must stay a plain value");
+
+//----------------------------------------------------------------------
+
+#endif  // ttt_game_state_hpp
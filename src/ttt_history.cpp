@@ -0,0 +1,445 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include "ttt_shared.hpp"
+#include "ttt_game_state.hpp"
+#include "ttt_history.hpp"
+
+//------------------------------------------------------------------------------
+
+/*
+** Counts the outcomes with 'outcome & mask == value'. Written without
+** branches so the compiler turns it into vector compares and adds.
+*/
+inline uint32_t ttt_count_outcomes(const uint8_t* outcomes, std::size_t n,
+                                   uint8_t mask, uint8_t value) {
+  uint32_t count = 0;
+  for (std::size_t i = 0; i < n; i++) {
+    count += (outcomes[i] & mask) == value;
+  }
+  return count;
+}
+
+inline uint32_t ttt_count_line(const uint8_t* outcomes, std::size_t n,
+                               ttt_line line) {
+  return ttt_count_outcomes(outcomes, n,
+                            uint8_t(0xff << ttt_outcome_line_shift),
+                            (uint8_t)line << ttt_outcome_line_shift);
+}
+
+//------------------------------------------------------------------------------
+
+/*
+** Loads the given sections of every segment, on all cores, and hands
+** each one to 'scan' along with the thread's own 'Result'. Returns the
+** sum of the results.
+*/
+template <typename Result, typename Scan>
+Result ttt_scan_segments(const std::vector<std::string>& paths,
+                         unsigned sections, Scan scan) {
+  unsigned n_threads = std::max(1u, std::thread::hardware_concurrency());
+  n_threads = std::min<std::size_t>(n_threads, paths.size());
+
+  std::vector<Result> results(n_threads);
+  std::atomic<std::size_t> next(0);
+  std::atomic<bool> failed(false);
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < n_threads; t++) {
+    threads.emplace_back([&, t]() {
+      for (std::size_t i; !failed && (i = next++) < paths.size();) {
+        ttt_history_segment segment;
+        if (!segment.load(paths[i], sections)) {
+          std::cerr << "Can't read '" << paths[i] << "'\n";
+          failed = true;
+        } else {
+          scan(segment, results[t]);
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (failed) {
+    throw std::runtime_error("Some segments could not be read");
+  }
+
+  Result total;
+  for (const auto& result : results) {
+    total += result;
+  }
+  return total;
+}
+
+//------------------------------------------------------------------------------
+
+struct ttt_summary {
+  uint64_t games = 0;
+  uint64_t wins[ttt_number_of_players] = {0, 0};
+  uint64_t draws = 0;
+  uint64_t forfeits = 0;
+  uint64_t lines[5] = {0, 0, 0, 0, 0};  // Indexed by ttt_line
+
+  ttt_summary& operator+=(const ttt_summary& other) {
+    games += other.games;
+    for (int i = 0; i < ttt_number_of_players; i++) {
+      wins[i] += other.wins[i];
+    }
+    draws += other.draws;
+    forfeits += other.forfeits;
+    for (int i = 0; i < 5; i++) {
+      lines[i] += other.lines[i];
+    }
+    return *this;
+  }
+};
+
+ttt_summary summarize(const std::vector<std::string>& paths) {
+  return ttt_scan_segments<ttt_summary>(
+      paths, ttt_history_segment::mask(ttt_history_segment::outcomes),
+      [](const ttt_history_segment& segment, ttt_summary& summary) {
+        const uint8_t* o = segment.outcome_list().data();
+        const std::size_t n = segment.outcome_list().size();
+        summary.games += n;
+        for (int i = 0; i < ttt_number_of_players; i++) {
+          summary.wins[i] +=
+              ttt_count_outcomes(o, n, ttt_outcome_winner_mask, i);
+        }
+        summary.draws += ttt_count_outcomes(
+            o, n, ttt_outcome_winner_mask, (uint8_t)ttt_player_id::none);
+        summary.forfeits += ttt_count_outcomes(o, n, ttt_outcome_forfeit,
+                                               ttt_outcome_forfeit);
+        for (int i = 0; i < 5; i++) {
+          summary.lines[i] += ttt_count_line(o, n, (ttt_line)i);
+        }
+      });
+}
+
+inline double percent(uint64_t part, uint64_t total) {
+  return (total ? 100.0 * part / total : 0.0);
+}
+
+void print_summary(const ttt_summary& summary) {
+  std::cout << summary.games << " games\n" << std::fixed
+            << std::setprecision(1);
+  for (int i = 0; i < ttt_number_of_players; i++) {
+    std::cout << "  Player " << i + 1 << " won " << summary.wins[i] << " ("
+              << percent(summary.wins[i], summary.games) << "%)\n";
+  }
+  std::cout << "  Tied " << summary.draws << " ("
+            << percent(summary.draws, summary.games) << "%)\n"
+            << "  Forfeited " << summary.forfeits << " ("
+            << percent(summary.forfeits, summary.games) << "%)\n";
+}
+
+void print_lines(const ttt_summary& summary) {
+  static const char* const names[] = {"none", "row", "column", "diagonal",
+                                      "anti-diagonal"};
+  const uint64_t won = summary.games - summary.lines[0];
+  std::cout << won << " games won on a line\n" << std::fixed
+            << std::setprecision(1);
+  for (int i = 1; i < 5; i++) {
+    std::cout << "  " << std::left << std::setw(14) << names[i] << std::right
+              << std::setw(12) << summary.lines[i] << " ("
+              << percent(summary.lines[i], won) << "%)\n";
+  }
+  const uint64_t diagonals = summary.lines[3] + summary.lines[4];
+  std::cout << "Either diagonal: " << diagonals << " ("
+            << percent(diagonals, won) << "%)\n";
+}
+
+//------------------------------------------------------------------------------
+
+/*
+** Games and wins of the first player, by the cell they opened with
+*/
+struct ttt_openings {
+  uint64_t games[ttt_number_of_cells] = {};
+  uint64_t wins[ttt_number_of_cells] = {};
+
+  ttt_openings& operator+=(const ttt_openings& other) {
+    for (int i = 0; i < ttt_number_of_cells; i++) {
+      games[i] += other.games[i];
+      wins[i] += other.wins[i];
+    }
+    return *this;
+  }
+};
+
+ttt_openings openings(const std::vector<std::string>& paths) {
+  return ttt_scan_segments<ttt_openings>(
+      paths,
+      ttt_history_segment::mask(ttt_history_segment::moves) |
+          ttt_history_segment::mask(ttt_history_segment::outcomes),
+      [](const ttt_history_segment& segment, ttt_openings& result) {
+        const uint64_t* m = segment.move_list().data();
+        const uint8_t* o = segment.outcome_list().data();
+        const std::size_t n = segment.move_list().size();
+
+        // Opening cell, or a cell past the board for games without moves,
+        // then whether player 1 won, in one byte per game
+        std::vector<uint8_t> keys(n);
+        for (std::size_t i = 0; i < n; i++) {
+          const unsigned cell = (ttt_packed_moves(m[i]) != 0
+                                     ? ttt_packed_cell(m[i], 0)
+                                     : unsigned(ttt_number_of_cells));
+          keys[i] = cell << 1 | ((o[i] & ttt_outcome_winner_mask) == 0);
+        }
+        for (int cell = 0; cell < ttt_number_of_cells; cell++) {
+          const uint32_t lost =
+              ttt_count_outcomes(keys.data(), n, 0xff, cell << 1);
+          const uint32_t won =
+              ttt_count_outcomes(keys.data(), n, 0xff, cell << 1 | 1);
+          result.games[cell] += lost + won;
+          result.wins[cell] += won;
+        }
+      });
+}
+
+void print_openings(const ttt_openings& result) {
+  std::cout << "Opening  Games         Player 1 wins\n" << std::fixed
+            << std::setprecision(1);
+  for (int cell = 0; cell < ttt_number_of_cells; cell++) {
+    std::cout << "  " << cell / ttt_board_side + 1 << ","
+              << cell % ttt_board_side + 1 << "    " << std::left
+              << std::setw(14) << result.games[cell] << std::right
+              << percent(result.wins[cell], result.games[cell]) << "%\n";
+  }
+}
+
+//------------------------------------------------------------------------------
+
+/*
+** Record of the games between two players, from the pair index
+*/
+struct ttt_pair_record {
+  enum { max_recent = 10 };
+
+  struct game {
+    int64_t time_ms;
+    uint64_t moves;
+    uint8_t outcome;
+    bool first_started;  // Did the first player of the query open?
+  };
+
+  uint64_t games = 0;
+  uint64_t wins[ttt_number_of_players] = {0, 0};  // Query order
+  uint64_t draws = 0;
+  uint64_t forfeits = 0;
+  std::vector<game> recent;  // Latest games, newest first
+
+  ttt_pair_record& operator+=(const ttt_pair_record& other) {
+    games += other.games;
+    for (int i = 0; i < ttt_number_of_players; i++) {
+      wins[i] += other.wins[i];
+    }
+    draws += other.draws;
+    forfeits += other.forfeits;
+    recent.insert(recent.end(), other.recent.begin(), other.recent.end());
+    std::sort(recent.begin(), recent.end(), [](const game& a, const game& b) {
+      return a.time_ms > b.time_ms;
+    });
+    if (recent.size() > max_recent) {
+      recent.resize(max_recent);
+    }
+    return *this;
+  }
+};
+
+ttt_pair_record pair_record(const std::vector<std::string>& paths,
+                            const std::string& first,
+                            const std::string& second) {
+  const unsigned sections = ~ttt_history_segment::mask(
+                                ttt_history_segment::player_2) &
+                            ttt_history_segment::all_sections;
+
+  return ttt_scan_segments<ttt_pair_record>(
+      paths, sections,
+      [&](const ttt_history_segment& segment, ttt_pair_record& result) {
+        const int64_t a = segment.find_name(first);
+        const int64_t b = segment.find_name(second);
+        if (a < 0 || b < 0) {
+          return;  // They never met here
+        }
+
+        ttt_pair_record local;
+        auto rows = segment.rows_of(a, b);
+        for (const uint32_t* row = rows.first; row != rows.second; ++row) {
+          const uint8_t outcome = segment.outcome_list()[*row];
+          const bool first_started = segment.player_1_ids()[*row] == a;
+          const ttt_player_id winner = ttt_outcome_winner(outcome);
+
+          local.games += 1;
+          if (winner == ttt_player_id::none) {
+            local.draws += 1;
+          } else {
+            local.wins[(winner == ttt_player_id::player_1) != first_started]
+                += 1;
+          }
+          local.forfeits += (outcome & ttt_outcome_forfeit) != 0;
+          local.recent.push_back({segment.time_list()[*row],
+                                  segment.move_list()[*row], outcome,
+                                  first_started});
+        }
+        result += local;
+      });
+}
+
+void print_pair_record(const ttt_pair_record& result, const std::string& first,
+                       const std::string& second) {
+  std::cout << first << " vs " << second << ": " << result.games
+            << " games, " << result.wins[0] << " won by " << first << ", "
+            << result.wins[1] << " won by " << second << ", " << result.draws
+            << " tied, " << result.forfeits << " forfeited\n";
+
+  for (const auto& g : result.recent) {
+    const std::time_t seconds = g.time_ms / 1000;
+    char when[32];
+    std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S",
+                  std::gmtime(&seconds));
+
+    std::cout << "  " << when << "  " << (g.first_started ? first : second)
+              << " opens:";
+    for (unsigned i = 0; i < ttt_packed_moves(g.moves); i++) {
+      const unsigned cell = ttt_packed_cell(g.moves, i);
+      std::cout << " " << cell / ttt_board_side + 1 << ","
+                << cell % ttt_board_side + 1;
+    }
+
+    const ttt_player_id winner = ttt_outcome_winner(g.outcome);
+    if (winner == ttt_player_id::none) {
+      std::cout << "  tie";
+    } else {
+      const bool first_won =
+          (winner == ttt_player_id::player_1) == g.first_started;
+      std::cout << "  " << (first_won ? first : second) << " wins";
+    }
+    if (g.outcome & ttt_outcome_forfeit) {
+      std::cout << " by forfeit";
+    }
+    std::cout << "\n";
+  }
+}
+
+//------------------------------------------------------------------------------
+
+/*
+** Adds 'n' random games between 'n_players' players, ending one a
+** second until now, as new segments
+*/
+void generate(const std::string& dir, uint64_t n, unsigned n_players) {
+  ::mkdir(dir.c_str(), 0755);
+  unsigned number = ttt_history_segment::next_number(dir);
+
+  std::mt19937 rng(0x7e57u);
+  std::uniform_int_distribution<unsigned> pick_player(0, n_players - 1);
+  std::uniform_int_distribution<int> pick_cell(0, ttt_number_of_cells - 1);
+  std::uniform_int_distribution<int> percent(0, 99);
+
+  const int64_t now =
+      std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count();
+
+  ttt_history_segment segment;
+  for (uint64_t i = 0; i < n; i++) {
+    const unsigned a = pick_player(rng);
+    const unsigned b = (a + 1 + pick_player(rng) % (n_players - 1)) % n_players;
+
+    ttt_game_result result;
+    std::snprintf(result.players[0], sizeof(result.players[0]), "player-%u",
+                  a);
+    std::snprintf(result.players[1], sizeof(result.players[1]), "player-%u",
+                  b);
+
+    ttt_game_state state;
+    state.start();
+    while (state.playing()) {
+      if (percent(rng) == 0) {
+        break;  // Someone quits
+      }
+      const int cell = pick_cell(rng);
+      state.try_move((int)state.current_player(), cell / ttt_board_side,
+                     cell % ttt_board_side);
+    }
+    result.winner = (state.playing() ? ttt_opponent(state.current_player())
+                                     : state.winner());
+
+    ttt_game_record record = ttt_make_record(result, state);
+    record.time_ms = now - int64_t(n - i) * 1000;
+    segment.append(record);
+
+    if (segment.full() || i + 1 == n) {
+      const std::string path = ttt_history_segment::path(dir, number++);
+      if (!segment.save(path)) {
+        throw std::runtime_error("Can't write '" + path + "'");
+      }
+      segment = ttt_history_segment();
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[]) {
+  try {
+    if (argc < 3) {
+      std::cerr << "Usage: history <dir> summary\n"
+                   "       history <dir> lines\n"
+                   "       history <dir> openings\n"
+                   "       history <dir> pair <player> <player>\n"
+                   "       history <dir> generate <games> [<players>]\n";
+      return 1;
+    }
+
+    const std::string dir = argv[1];
+    const std::string command = argv[2];
+
+    if (command == "generate" && argc > 3) {
+      const unsigned n_players = (argc > 4 ? std::atoi(argv[4]) : 1000);
+      if (n_players < 2) {
+        std::cerr << "Games need at least 2 players\n";
+        return 1;
+      }
+      generate(dir, std::strtoull(argv[3], nullptr, 10), n_players);
+      return 0;
+    }
+
+    const std::vector<std::string> paths = ttt_history_segment::list(dir);
+    auto start = std::chrono::steady_clock::now();
+
+    if (command == "summary") {
+      print_summary(summarize(paths));
+    } else if (command == "lines") {
+      print_lines(summarize(paths));
+    } else if (command == "openings") {
+      print_openings(openings(paths));
+    } else if (command == "pair" && argc > 4) {
+      print_pair_record(pair_record(paths, argv[3], argv[4]), argv[3],
+                        argv[4]);
+    } else {
+      std::cerr << "Unknown command '" << command << "'\n";
+      return 1;
+    }
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << "Scanned " << paths.size() << " segment(s) in "
+              << std::setprecision(3) << elapsed.count() << "s\n";
+  } catch (std::exception& e) {
+    std::cerr << "Exception: " << e.what() << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,838 @@
+#ifndef ttt_history_hpp
+#define ttt_history_hpp
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ttt_game_state.hpp"
+#include "ttt_ratings.hpp"
+#include "ttt_write_behind.hpp"
+
+//----------------------------------------------------------------------
+
+/*
+** Outcome of a game in a byte: the winner in the low 2 bits (a
+** ttt_player_id, 'none' for ties), a forfeit flag, then the line won
+*/
+enum { ttt_outcome_winner_mask = 0x3 };
+enum { ttt_outcome_forfeit = 0x4 };
+enum { ttt_outcome_line_shift = 3 };
+
+inline uint8_t ttt_make_outcome(ttt_player_id winner, bool forfeit,
+                                ttt_line line) {
+  return (uint8_t)winner | (forfeit ? ttt_outcome_forfeit : 0) |
+         ((uint8_t)line << ttt_outcome_line_shift);
+}
+
+inline ttt_player_id ttt_outcome_winner(uint8_t outcome) {
+  return (ttt_player_id)(outcome & ttt_outcome_winner_mask);
+}
+
+inline ttt_line ttt_outcome_line(uint8_t outcome) {
+  return (ttt_line)(outcome >> ttt_outcome_line_shift);
+}
+
+/*
+** Moves of a game in 40 bits: the number of moves in the low nibble,
+** then the cell of every move, a nibble each
+*/
+static_assert(ttt_number_of_cells <= 9,
+              "Packed moves hold up to 9 cells of 4 bits, after the count");
+inline uint64_t ttt_pack_moves(const ttt_game_state& state) {
+  uint64_t packed = state.moves();
+  for (unsigned i = 0; i < state.moves(); i++) {
+    packed |= uint64_t(state.cell_at(i)) << (4 + 4 * i);
+  }
+  return packed;
+}
+
+inline unsigned ttt_packed_moves(uint64_t packed) { return packed & 0xf; }
+
+inline unsigned ttt_packed_cell(uint64_t packed, unsigned i) {
+  return (packed >> (4 + 4 * i)) & 0xf;
+}
+
+//----------------------------------------------------------------------
+
+/*
+** A finished game, as recorded. It is a plain value, so it can go
+** through a lock-free queue by copy.
+*/
+struct ttt_game_record {
+  char players[ttt_number_of_players][ttt_game_result::max_name];
+  int64_t time_ms;  // When it ended, since the epoch
+  uint64_t moves;   // See ttt_pack_moves
+  uint8_t outcome;  // See ttt_make_outcome
+};
+
+inline ttt_game_record ttt_make_record(const ttt_game_result& result,
+                                       const ttt_game_state& state) {
+  ttt_game_record record;
+  std::memcpy(record.players, result.players, sizeof(record.players));
+  record.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count();
+  record.moves = ttt_pack_moves(state);
+  // Games still running when they end were given up by a player
+  record.outcome =
+      ttt_make_outcome(result.winner, state.playing(), state.line());
+  return record;
+}
+
+//----------------------------------------------------------------------
+
+/*
+** Up to 'max_rows' games, stored by column. Player names are encoded as
+** indexes into a dictionary, times as deltas, moves in 5 bytes and
+** outcomes in one. A secondary index lists the rows of every pair of
+** players. Readers load only the columns they ask for.
+**
+** File layout: "TTTH", version, ID width (2 or 4 bytes), two padding
+** bytes, the row and name counts (u32), and the offsets (u64) of every
+** section, then the sections. Integers are little endian.
+**
+** A segment still being filled lives in a journal instead, which only
+** ever grows: rows one after the other, each with both names (length,
+** then bytes), the time (i64), the moves and the outcome. Journals are
+** read like segments, all sections at once.
+*/
+class ttt_history_segment {
+ public:
+  enum { max_rows = 1 << 16 };
+  enum { format_version = 1 };
+  enum { move_bytes = 5 };  // Packed moves take 40 bits
+
+  enum section {
+    names,
+    player_1,
+    player_2,
+    times,
+    moves,
+    outcomes,
+    pair_keys,    // Sorted (low ID << 32 | high ID) of every pair
+    pair_starts,  // Where the rows of each pair start in 'pair_rows'
+    pair_rows,
+    section_count
+  };
+
+  /*
+  ** Sections wanted by a reader, as a bit mask
+  */
+  static unsigned mask(section s) { return 1u << s; }
+
+  enum { all_sections = (1u << section_count) - 1 };
+
+  enum { header_size = 16 + 8 * (section_count + 1) };
+
+  std::size_t size() const { return player_1_.size(); }
+
+  bool full() const { return size() >= max_rows; }
+
+  void append(const ttt_game_record& record) {
+    player_1_.push_back(name_id(record.players[0]));
+    player_2_.push_back(name_id(record.players[1]));
+    times_.push_back(record.time_ms);
+    moves_.push_back(record.moves);
+    outcomes_.push_back(record.outcome);
+  }
+
+  /*
+  ** Dictionary ID of a player name, or -1 if it never played here
+  */
+  int64_t find_name(const std::string& name) const {
+    auto it = ids_.find(name);
+    return (it == ids_.end() ? -1 : int64_t(it->second));
+  }
+
+  const std::vector<std::string>& name_list() const { return names_; }
+  const std::vector<uint32_t>& player_1_ids() const { return player_1_; }
+  const std::vector<uint32_t>& player_2_ids() const { return player_2_; }
+  const std::vector<int64_t>& time_list() const { return times_; }
+  const std::vector<uint64_t>& move_list() const { return moves_; }
+  const std::vector<uint8_t>& outcome_list() const { return outcomes_; }
+
+  /*
+  ** Rows where the given players met, in the order they were played.
+  ** Needs the pair index sections.
+  */
+  std::pair<const uint32_t*, const uint32_t*> rows_of(uint32_t a,
+                                                      uint32_t b) const {
+    const uint64_t key = pair_key(a, b);
+    auto it = std::lower_bound(pair_keys_.begin(), pair_keys_.end(), key);
+    if (it == pair_keys_.end() || *it != key) {
+      return std::make_pair(nullptr, nullptr);
+    }
+    const std::size_t i = it - pair_keys_.begin();
+    const uint32_t* rows = pair_rows_.data();
+    return std::make_pair(rows + pair_starts_[i], rows + pair_starts_[i + 1]);
+  }
+
+  /*
+  ** Writes the segment next to 'path', then swaps it in
+  */
+  bool save(const std::string& path) {
+    build_pair_index();
+
+    const bool wide = names_.size() > 0xffff;
+    std::string sections[section_count];
+
+    for (const auto& name : names_) {
+      put(sections[names], uint8_t(name.size()));
+      sections[names] += name;
+    }
+    for (std::size_t i = 0; i < size(); i++) {
+      put_id(sections[player_1], player_1_[i], wide);
+      put_id(sections[player_2], player_2_[i], wide);
+      int64_t delta = times_[i] - (i ? times_[i - 1] : 0);
+      put_varint(sections[times], (uint64_t(delta) << 1) ^ (delta >> 63));
+      put(sections[moves], moves_[i], move_bytes);
+      put(sections[outcomes], outcomes_[i]);
+    }
+    for (uint64_t key : pair_keys_) {
+      put(sections[pair_keys], key);
+    }
+    for (uint32_t start : pair_starts_) {
+      put(sections[pair_starts], start);
+    }
+    for (uint32_t row : pair_rows_) {
+      put(sections[pair_rows], row);
+    }
+
+    std::string out = "TTTH";
+    put(out, uint8_t(format_version));
+    put(out, uint8_t(wide ? 4 : 2));
+    put(out, uint16_t(0));
+    put(out, uint32_t(size()));
+    put(out, uint32_t(names_.size()));
+    uint64_t offset = header_size;
+    for (const auto& section : sections) {
+      put(out, offset);
+      offset += section.size();
+    }
+    put(out, offset);  // End of the last section
+    for (const auto& section : sections) {
+      out += section;
+    }
+
+    const std::string tmp_path = path + ".tmp";
+    std::FILE* f = std::fopen(tmp_path.c_str(), "wb");
+    if (!f) {
+      return false;
+    }
+    const bool written =
+        std::fwrite(out.data(), 1, out.size(), f) == out.size();
+    return std::fclose(f) == 0 && written &&
+           std::rename(tmp_path.c_str(), path.c_str()) == 0;
+  }
+
+  /*
+  ** Appends the rows from 'first' on to the journal at 'path'. On
+  ** failure, the journal is left as it was.
+  */
+  bool append_journal(const std::string& path, std::size_t first) const {
+    std::string out;
+    for (std::size_t i = first; i < size(); i++) {
+      for (uint32_t id : {player_1_[i], player_2_[i]}) {
+        put(out, uint8_t(names_[id].size()));
+        out += names_[id];
+      }
+      put(out, times_[i]);
+      put(out, moves_[i], move_bytes);
+      put(out, outcomes_[i]);
+    }
+
+    std::FILE* f = std::fopen(path.c_str(), "ab");
+    if (!f) {
+      return false;
+    }
+    long before = -1;
+    if (std::fseek(f, 0, SEEK_END) == 0) {
+      before = std::ftell(f);
+    }
+    const bool written =
+        before >= 0 && std::fwrite(out.data(), 1, out.size(), f) == out.size();
+    if (std::fclose(f) == 0 && written) {
+      return true;
+    }
+    // Take back whatever made it, so the next try starts on a row
+    if (before >= 0) {
+      const int ignored = ::truncate(path.c_str(), before);
+      (void)ignored;
+    }
+    return false;
+  }
+
+  /*
+  ** Reads the sections in 'sections' of a segment file, or all of a
+  ** journal. Files that are truncated or inconsistent are rejected as a
+  ** whole: a loaded segment only has IDs and rows that index its own
+  ** columns. Journals may end in a row that was being written, which
+  ** is left out.
+  */
+  bool load(const std::string& path, unsigned sections = all_sections) {
+    std::FILE* f = std::fopen(path.c_str(), "rb");
+    if (!f) {
+      return false;
+    }
+    const bool ok = (is_journal(path) ? load_journal(f) : load(f, sections));
+    std::fclose(f);
+    return ok;
+  }
+
+  static bool is_journal(const std::string& path) {
+    return path.size() >= 5 && path.compare(path.size() - 5, 5, ".tthj") == 0;
+  }
+
+  /*
+  ** Lists the segment files of a history directory, oldest first, with
+  ** the journal of a segment when it was never saved
+  */
+  static std::vector<std::string> list(const std::string& dir) {
+    std::map<unsigned, std::string> found;
+    DIR* d = ::opendir(dir.c_str());
+    if (!d) {
+      return std::vector<std::string>();
+    }
+    while (struct dirent* entry = ::readdir(d)) {
+      unsigned number;
+      char extension[5];
+      if (std::strlen(entry->d_name) != 17 ||
+          std::sscanf(entry->d_name, "seg-%8u.%4s", &number, extension) !=
+              2) {
+        continue;
+      }
+      const std::string entry_path = dir + "/" + entry->d_name;
+      if (std::strcmp(extension, "ttth") == 0) {
+        found[number] = entry_path;
+      } else if (std::strcmp(extension, "tthj") == 0) {
+        found.insert(std::make_pair(number, entry_path));
+      }
+    }
+    ::closedir(d);
+
+    std::vector<std::string> paths;
+    for (const auto& entry : found) {
+      paths.push_back(entry.second);
+    }
+    return paths;
+  }
+
+  /*
+  ** Number of the segment to start after the ones in 'dir'
+  */
+  static unsigned next_number(const std::string& dir) {
+    std::vector<std::string> paths = list(dir);
+    unsigned number = 0;
+    if (!paths.empty() &&
+        std::sscanf(paths.back().c_str() + dir.size(), "/seg-%8u",
+                    &number) == 1) {
+      number += 1;
+    }
+    return number;
+  }
+
+  static std::string path(const std::string& dir, unsigned number) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/seg-%08u.ttth", number);
+    return dir + name;
+  }
+
+  static std::string journal_path(const std::string& dir, unsigned number) {
+    char name[32];
+    std::snprintf(name, sizeof(name), "/seg-%08u.tthj", number);
+    return dir + name;
+  }
+
+ private:
+  static uint64_t pair_key(uint32_t a, uint32_t b) {
+    return (a < b ? (uint64_t(a) << 32) | b : (uint64_t(b) << 32) | a);
+  }
+
+  uint32_t name_id(const char* name) {
+    auto it = ids_.find(name);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    const uint32_t id = names_.size();
+    names_.push_back(name);
+    ids_[names_.back()] = id;
+    return id;
+  }
+
+  void build_pair_index() {
+    std::vector<std::pair<uint64_t, uint32_t>> entries(size());
+    for (std::size_t i = 0; i < size(); i++) {
+      entries[i] = std::make_pair(pair_key(player_1_[i], player_2_[i]), i);
+    }
+    std::sort(entries.begin(), entries.end());
+
+    pair_keys_.clear();
+    pair_starts_.clear();
+    pair_rows_.resize(entries.size());
+    for (std::size_t i = 0; i < entries.size(); i++) {
+      if (i == 0 || entries[i].first != entries[i - 1].first) {
+        pair_keys_.push_back(entries[i].first);
+        pair_starts_.push_back(i);
+      }
+      pair_rows_[i] = entries[i].second;
+    }
+    pair_starts_.push_back(entries.size());
+  }
+
+  bool load(std::FILE* f, unsigned wanted) {
+    char magic[4];
+    uint8_t version, width, pad[2];
+    uint32_t rows, n_names;
+    uint64_t offsets[section_count + 1];
+    if (std::fread(magic, 1, 4, f) != 4 || std::memcmp(magic, "TTTH", 4) ||
+        !get(f, version) || version != format_version || !get(f, width) ||
+        (width != 2 && width != 4) || std::fread(pad, 1, 2, f) != 2 ||
+        !get(f, rows) || rows > max_rows || !get(f, n_names)) {
+      return false;
+    }
+    for (auto& offset : offsets) {
+      if (!get(f, offset)) {
+        return false;
+      }
+    }
+
+    // Sections follow each other from the header to the end of the file
+    long file_size;
+    if (std::fseek(f, 0, SEEK_END) != 0 || (file_size = std::ftell(f)) < 0 ||
+        offsets[0] != header_size ||
+        offsets[section_count] != uint64_t(file_size)) {
+      return false;
+    }
+    for (unsigned s = 0; s < section_count; s++) {
+      if (offsets[s + 1] < offsets[s] ||
+          !size_ok(section(s), offsets[s + 1] - offsets[s], rows, width,
+                   offsets[pair_keys + 1] - offsets[pair_keys])) {
+        return false;
+      }
+    }
+
+    for (unsigned s = 0; s < section_count; s++) {
+      if (!(wanted & mask(section(s)))) {
+        continue;
+      }
+
+      std::string bytes(offsets[s + 1] - offsets[s], '\0');
+      if (std::fseek(f, offsets[s], SEEK_SET) != 0 ||
+          std::fread(&bytes[0], 1, bytes.size(), f) != bytes.size()) {
+        return false;
+      }
+      const char* p = bytes.data();
+      const char* end = p + bytes.size();
+
+      bool ok = true;
+      switch (s) {
+        case names:
+          names_.clear();
+          ids_.clear();
+          while (p < end && p + 1 + uint8_t(*p) <= end) {
+            ids_.insert(std::make_pair(std::string(p + 1, uint8_t(*p)),
+                                       uint32_t(names_.size())));
+            names_.push_back(std::string(p + 1, uint8_t(*p)));
+            p += 1 + uint8_t(*p);
+          }
+          ok = p == end && names_.size() == n_names;
+          break;
+        case player_1:
+          ok = read_ids(p, rows, width, n_names, player_1_);
+          break;
+        case player_2:
+          ok = read_ids(p, rows, width, n_names, player_2_);
+          break;
+        case times:
+          times_.resize(rows);
+          for (uint32_t i = 0; i < rows && ok; i++) {
+            uint64_t z;
+            ok = get_varint(p, end, z);
+            const int64_t delta = int64_t(z >> 1) ^ -int64_t(z & 1);
+            times_[i] = (i ? times_[i - 1] : 0) + delta;
+          }
+          ok = ok && p == end;
+          break;
+        case moves:
+          moves_.resize(rows);
+          for (uint32_t i = 0; i < rows && ok; i++) {
+            moves_[i] = get_le(p + move_bytes * i, move_bytes);
+            ok = moves_ok(moves_[i]);
+          }
+          break;
+        case outcomes:
+          outcomes_.assign(p, end);
+          break;
+        case pair_keys:
+          read_array(p, end, pair_keys_);
+          for (std::size_t i = 1; i < pair_keys_.size() && ok; i++) {
+            ok = pair_keys_[i - 1] < pair_keys_[i];  // For binary search
+          }
+          break;
+        case pair_starts:
+          read_array(p, end, pair_starts_);
+          // Every pair has rows, in order, and they cover all of them
+          ok = pair_starts_.front() == 0 && pair_starts_.back() == rows;
+          for (std::size_t i = 1; i < pair_starts_.size() && ok; i++) {
+            ok = pair_starts_[i - 1] < pair_starts_[i];
+          }
+          break;
+        case pair_rows:
+          read_array(p, end, pair_rows_);
+          for (std::size_t i = 0; i < pair_rows_.size() && ok; i++) {
+            ok = pair_rows_[i] < rows;
+          }
+          break;
+      }
+      if (!ok) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool load_journal(std::FILE* f) {
+    std::string bytes;
+    char buffer[64 * 1024];
+    for (std::size_t n; (n = std::fread(buffer, 1, sizeof(buffer), f)) > 0;) {
+      bytes.append(buffer, n);
+    }
+    if (std::ferror(f)) {
+      return false;
+    }
+
+    const char* p = bytes.data();
+    const char* end = p + bytes.size();
+    while (p < end) {
+      ttt_game_record record;
+      bool complete = true;
+      for (auto& name : record.players) {
+        if (p >= end || p + 1 + uint8_t(*p) > end) {
+          complete = false;
+          break;
+        }
+        if (uint8_t(*p) >= sizeof(name)) {
+          return false;
+        }
+        std::memcpy(name, p + 1, uint8_t(*p));
+        name[uint8_t(*p)] = '\0';
+        p += 1 + uint8_t(*p);
+      }
+      if (!complete || end - p < 8 + move_bytes + 1) {
+        break;  // Cut short while being written
+      }
+      record.time_ms = int64_t(get_le(p, 8));
+      record.moves = get_le(p + 8, move_bytes);
+      record.outcome = uint8_t(p[8 + move_bytes]);
+      p += 8 + move_bytes + 1;
+      if (!moves_ok(record.moves) || full()) {
+        return false;
+      }
+      append(record);
+    }
+    build_pair_index();
+    return true;
+  }
+
+  /*
+  ** Does a section of 'size' bytes fit a segment of 'rows' rows? Names
+  ** and times vary in length, so their contents are checked on load.
+  */
+  static bool size_ok(section s, uint64_t size, uint32_t rows, uint8_t width,
+                      uint64_t pair_keys_size) {
+    switch (s) {
+      case names:
+        return true;
+      case player_1:
+      case player_2:
+        return size == uint64_t(rows) * width;
+      case times:
+        return size >= rows && size <= uint64_t(rows) * max_varint_bytes;
+      case moves:
+        return size == uint64_t(rows) * move_bytes;
+      case outcomes:
+        return size == rows;
+      case pair_keys:
+        return size % 8 == 0 && size / 8 <= rows;
+      case pair_starts:
+        return size == (pair_keys_size / 8 + 1) * 4;
+      case pair_rows:
+        return size == uint64_t(rows) * 4;
+      default:
+        return false;
+    }
+  }
+
+  /*
+  ** Are the packed moves of a game a possible game?
+  */
+  static bool moves_ok(uint64_t packed) {
+    if (ttt_packed_moves(packed) > ttt_number_of_cells) {
+      return false;
+    }
+    for (unsigned i = 0; i < ttt_packed_moves(packed); i++) {
+      if (ttt_packed_cell(packed, i) >= ttt_number_of_cells) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  template <typename T>
+  static void put(std::string& out, T v, unsigned bytes = sizeof(T)) {
+    for (unsigned i = 0; i < bytes; i++) {
+      out += char((uint64_t(v) >> (8 * i)) & 0xff);
+    }
+  }
+
+  static uint64_t get_le(const char* p, unsigned bytes) {
+    uint64_t v = 0;
+    for (unsigned i = 0; i < bytes; i++) {
+      v |= uint64_t(uint8_t(p[i])) << (8 * i);
+    }
+    return v;
+  }
+
+  static void put_id(std::string& out, uint32_t id, bool wide) {
+    if (wide) {
+      put(out, id);
+    } else {
+      put(out, uint16_t(id));
+    }
+  }
+
+  static void put_varint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+      out += char(v | 0x80);
+      v >>= 7;
+    }
+    out += char(v);
+  }
+
+  enum { max_varint_bytes = 10 };  // 64 bits, 7 at a time
+
+  static bool get_varint(const char*& p, const char* end, uint64_t& v) {
+    v = 0;
+    for (unsigned shift = 0; p < end && shift < 7 * max_varint_bytes;
+         shift += 7) {
+      const uint8_t byte = *p++;
+      v |= uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  template <typename T>
+  static bool get(std::FILE* f, T& v) {
+    unsigned char bytes[sizeof(T)];
+    if (std::fread(bytes, 1, sizeof(T), f) != sizeof(T)) {
+      return false;
+    }
+    uint64_t value = 0;
+    for (unsigned i = 0; i < sizeof(T); i++) {
+      value |= uint64_t(bytes[i]) << (8 * i);
+    }
+    v = T(value);
+    return true;
+  }
+
+  /*
+  ** Readers below rely on 'size_ok' for the length of their section
+  */
+  template <typename T>
+  static void read_array(const char* p, const char* end,
+                         std::vector<T>& values) {
+    values.resize((end - p) / sizeof(T));
+    for (std::size_t i = 0; i < values.size(); i++) {
+      values[i] = T(get_le(p + sizeof(T) * i, sizeof(T)));
+    }
+  }
+
+  static bool read_ids(const char* p, uint32_t rows, uint8_t width,
+                       uint32_t n_names, std::vector<uint32_t>& ids) {
+    ids.resize(rows);
+    for (uint32_t i = 0; i < rows; i++) {
+      ids[i] = uint32_t(get_le(p + width * i, width));
+      if (ids[i] >= n_names) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  std::vector<std::string> names_;
+  std::unordered_map<std::string, uint32_t> ids_;  // Of 'names_'
+  std::vector<uint32_t> player_1_;
+  std::vector<uint32_t> player_2_;
+  std::vector<int64_t> times_;
+  std::vector<uint64_t> moves_;
+  std::vector<uint8_t> outcomes_;
+  std::vector<uint64_t> pair_keys_;
+  std::vector<uint32_t> pair_starts_;
+  std::vector<uint32_t> pair_rows_;
+};
+
+//----------------------------------------------------------------------
+
+/*
+** Records finished games into a history directory. Like the rating
+** store, it takes records from the game thread without waiting and
+** leaves storage to a background thread. Every few seconds, the games
+** added since the last time go to the journal of the segment being
+** filled; the segment itself is written once, when it is full or on
+** exit. Segments that can't be written are kept and tried again, and
+** journals left by a crash are saved as segments on the next start.
+*/
+class ttt_history_writer {
+ public:
+  enum { queue_capacity = 4096 };
+  enum { batch_ms = 50 };
+  enum { flush_seconds = 5 };
+
+  explicit ttt_history_writer(const std::string& dir)
+      : dir_(dir),
+        records_(std::chrono::milliseconds(batch_ms),
+                 std::chrono::seconds(flush_seconds)) {
+    ::mkdir(dir_.c_str(), 0755);  // May exist already
+
+    recover();
+
+    // New games go to new segments, after the ones already there
+    segment_number_ = ttt_history_segment::next_number(dir_);
+
+    records_.start(
+        [this](const std::vector<ttt_game_record>& batch) { append(batch); },
+        [this]() { return flush(); });
+  }
+
+  ~ttt_history_writer() {
+    records_.stop();
+    if (segment_.size() > 0) {
+      seal();
+    }
+    retry_unsealed();
+  }
+
+  /*
+  ** Queues a game to be recorded. Called from the game thread only;
+  ** it never blocks.
+  */
+  void submit(const ttt_game_record& record) { records_.submit(record); }
+
+ private:
+  /*
+  ** Saves the journals of segments that were never saved
+  */
+  void recover() {
+    for (const auto& path : ttt_history_segment::list(dir_)) {
+      ttt_history_segment segment;
+      unsigned number;
+      if (!ttt_history_segment::is_journal(path) ||
+          std::sscanf(path.c_str() + dir_.size(), "/seg-%8u", &number) != 1) {
+        continue;
+      }
+      if (!segment.load(path) ||
+          !segment.save(ttt_history_segment::path(dir_, number))) {
+        std::cerr << "History: can't recover '" << path << "'\n";
+        continue;
+      }
+      std::remove(path.c_str());
+    }
+  }
+
+  /*
+  ** Worker thread: adds games to the segment being filled, and seals
+  ** it whenever it is full
+  */
+  void append(const std::vector<ttt_game_record>& batch) {
+    for (const auto& record : batch) {
+      segment_.append(record);
+      if (segment_.full()) {
+        seal();
+      }
+    }
+  }
+
+  /*
+  ** Writes the segment being filled for good, and starts the next one.
+  ** If it can't be written, it is kept to be tried again.
+  */
+  void seal() {
+    if (!save(segment_number_, segment_)) {
+      std::cerr << "History: can't write '"
+                << ttt_history_segment::path(dir_, segment_number_)
+                << "', will try again\n";
+      unsealed_.push_back(std::make_pair(segment_number_, std::move(segment_)));
+    }
+    segment_ = ttt_history_segment();
+    segment_number_ += 1;
+    journaled_ = 0;
+  }
+
+  bool save(unsigned number, ttt_history_segment& segment) {
+    if (!segment.save(ttt_history_segment::path(dir_, number))) {
+      return false;
+    }
+    std::remove(ttt_history_segment::journal_path(dir_, number).c_str());
+    return true;
+  }
+
+  /*
+  ** Returns true if every segment that failed before is written now
+  */
+  bool retry_unsealed() {
+    for (auto it = unsealed_.begin(); it != unsealed_.end();) {
+      if (save(it->first, it->second)) {
+        it = unsealed_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    return unsealed_.empty();
+  }
+
+  bool flush() {
+    bool ok = retry_unsealed();
+    if (journaled_ < segment_.size()) {
+      const std::string path =
+          ttt_history_segment::journal_path(dir_, segment_number_);
+      if (segment_.append_journal(path, journaled_)) {
+        journaled_ = segment_.size();
+      } else {
+        std::cerr << "History: can't write '" << path
+                  << "', will try again\n";
+        ok = false;
+      }
+    }
+    return ok;
+  }
+
+ private:
+  std::string dir_;
+  unsigned segment_number_ = 0;
+  // Worker thread only, then the destructor
+  ttt_history_segment segment_;
+  std::size_t journaled_ = 0;  // Rows of 'segment_' in its journal
+  std::vector<std::pair<unsigned, ttt_history_segment>> unsealed_;
+  ttt_write_behind<ttt_game_record, queue_capacity> records_;
+};
+
+//----------------------------------------------------------------------
+
+#endif  // ttt_history_hpp
@@ -0,0 +1,297 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <exception>
+#include <stdexcept>
+#include <vector>
+#include <unistd.h>
+#include "ttt_game_state.hpp"
+#include "ttt_history.hpp"
+
+//------------------------------------------------------------------------------
+
+/*
+** Checks the history segment format: what is saved loads back the same,
+** and truncated or corrupted files are either rejected or load into a
+** segment whose IDs and rows stay within its own columns.
+*/
+
+#define TTT_CHECK(condition)                                            \
+  do {                                                                  \
+    if (!(condition)) {                                                 \
+      throw std::runtime_error(std::string(__FILE__ ":") +              \
+                               std::to_string(__LINE__) + ": " +        \
+                               #condition);                             \
+    }                                                                   \
+  } while (0)
+
+/*
+** Random games between the given players, with times going back and
+** forth a little so that deltas are negative now and then
+*/
+std::vector<ttt_game_record> make_records(std::size_t n,
+                                          const std::vector<std::string>&
+                                              players,
+                                          std::mt19937& rng) {
+  std::uniform_int_distribution<std::size_t> pick(0, players.size() - 1);
+  std::uniform_int_distribution<int> cell(0, ttt_number_of_cells - 1);
+  std::uniform_int_distribution<int> jitter(-500, 5000);
+
+  std::vector<ttt_game_record> records;
+  int64_t time_ms = 1700000000000;
+  for (std::size_t i = 0; i < n; i++) {
+    ttt_game_result result;
+    const std::size_t a = pick(rng);
+    const std::size_t b = (a + 1 + pick(rng) % (players.size() - 1)) %
+                          players.size();
+    std::snprintf(result.players[0], sizeof(result.players[0]), "%s",
+                  players[a].c_str());
+    std::snprintf(result.players[1], sizeof(result.players[1]), "%s",
+                  players[b].c_str());
+
+    ttt_game_state state;
+    state.start();
+    for (unsigned tries = rng() % 30; state.playing() && tries > 0;
+         tries--) {
+      const int c = cell(rng);
+      state.try_move((int)state.current_player(), c / ttt_board_side,
+                     c % ttt_board_side);
+    }
+    result.winner = state.winner();
+
+    ttt_game_record record = ttt_make_record(result, state);
+    time_ms += jitter(rng);
+    record.time_ms = time_ms;
+    records.push_back(record);
+  }
+  return records;
+}
+
+std::vector<std::string> make_players(std::size_t n, const char* prefix) {
+  std::vector<std::string> players;
+  for (std::size_t i = 0; i < n; i++) {
+    players.push_back(prefix + std::to_string(i));
+  }
+  return players;
+}
+
+/*
+** Would a reader indexing columns with what was loaded stay in bounds?
+*/
+void check_bounds(const ttt_history_segment& segment) {
+  const std::size_t rows = segment.player_1_ids().size();
+  const std::size_t n_names = segment.name_list().size();
+  for (std::size_t i = 0; i < rows; i++) {
+    TTT_CHECK(segment.player_1_ids()[i] < n_names);
+    TTT_CHECK(segment.player_2_ids()[i] < n_names);
+  }
+  TTT_CHECK(segment.time_list().size() == rows);
+  TTT_CHECK(segment.move_list().size() == rows);
+  TTT_CHECK(segment.outcome_list().size() == rows);
+
+  for (std::size_t a = 0; a < n_names; a++) {
+    for (std::size_t b = 0; b < n_names; b++) {
+      auto found = segment.rows_of(a, b);
+      TTT_CHECK(found.first <= found.second);
+      for (const uint32_t* row = found.first; row != found.second; ++row) {
+        TTT_CHECK(*row < rows);
+      }
+    }
+  }
+}
+
+/*
+** Saves the records as a segment, loads it back and compares
+*/
+void check_round_trip(const std::string& path,
+                      const std::vector<ttt_game_record>& records) {
+  ttt_history_segment saved;
+  for (const auto& record : records) {
+    saved.append(record);
+  }
+  TTT_CHECK(saved.save(path));
+
+  ttt_history_segment loaded;
+  TTT_CHECK(loaded.load(path));
+  TTT_CHECK(loaded.size() == records.size());
+  TTT_CHECK(loaded.name_list() == saved.name_list());
+  for (std::size_t id = 0; id < loaded.name_list().size(); id++) {
+    TTT_CHECK(loaded.find_name(loaded.name_list()[id]) == int64_t(id));
+  }
+  TTT_CHECK(loaded.find_name("nobody played as this") == -1);
+  for (std::size_t i = 0; i < records.size(); i++) {
+    const auto& names = loaded.name_list();
+    TTT_CHECK(names[loaded.player_1_ids()[i]] == records[i].players[0]);
+    TTT_CHECK(names[loaded.player_2_ids()[i]] == records[i].players[1]);
+    TTT_CHECK(loaded.time_list()[i] == records[i].time_ms);
+    TTT_CHECK(loaded.move_list()[i] == records[i].moves);
+    TTT_CHECK(loaded.outcome_list()[i] == records[i].outcome);
+  }
+
+  // The pair index lists exactly the rows of every pair, in order
+  const uint32_t n_names = loaded.name_list().size();
+  for (uint32_t a = 0; a < n_names && a < 64; a++) {
+    for (uint32_t b = 0; b < n_names && b < 64; b++) {
+      std::vector<uint32_t> expected;
+      for (uint32_t i = 0; i < records.size(); i++) {
+        const uint32_t p1 = loaded.player_1_ids()[i];
+        const uint32_t p2 = loaded.player_2_ids()[i];
+        if ((p1 == a && p2 == b) || (p1 == b && p2 == a)) {
+          expected.push_back(i);
+        }
+      }
+      auto found = loaded.rows_of(a, b);
+      TTT_CHECK(std::vector<uint32_t>(found.first, found.second) ==
+                expected);
+    }
+  }
+
+  // Readers get only the sections they ask for
+  ttt_history_segment outcomes_only;
+  TTT_CHECK(outcomes_only.load(
+      path, ttt_history_segment::mask(ttt_history_segment::outcomes)));
+  TTT_CHECK(outcomes_only.outcome_list() == loaded.outcome_list());
+  TTT_CHECK(outcomes_only.move_list().empty());
+}
+
+std::string read_file(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  return std::string((std::istreambuf_iterator<char>(file)),
+                     std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string& path, const std::string& bytes) {
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file.write(bytes.data(), bytes.size());
+  TTT_CHECK(file.good());
+}
+
+/*
+** Every prefix of a segment file is rejected
+*/
+void check_truncation(const std::string& path) {
+  const std::string bytes = read_file(path);
+  const std::string cut_path = path + ".cut";
+  for (std::size_t length = 0; length < bytes.size(); length++) {
+    write_file(cut_path, bytes.substr(0, length));
+    ttt_history_segment segment;
+    TTT_CHECK(!segment.load(cut_path));
+  }
+  std::remove(cut_path.c_str());
+}
+
+/*
+** Changing any byte of a segment file either gets it rejected, or
+** loads something readers can index safely
+*/
+void check_corruption(const std::string& path) {
+  const std::string bytes = read_file(path);
+  const std::string bad_path = path + ".bad";
+  const uint8_t values[] = {0x00, 0x01, 0x7f, 0x80, 0xff};
+  for (std::size_t i = 0; i < bytes.size(); i++) {
+    for (uint8_t value : values) {
+      std::string bad = bytes;
+      bad[i] = char(value);
+      write_file(bad_path, bad);
+      ttt_history_segment segment;
+      if (segment.load(bad_path)) {
+        check_bounds(segment);
+      }
+    }
+  }
+  std::remove(bad_path.c_str());
+}
+
+/*
+** Journals written a bit at a time load back all their rows, and a row
+** cut short at the end is left out
+*/
+void check_journal(const std::string& path,
+                   const std::vector<ttt_game_record>& records) {
+  std::remove(path.c_str());
+  ttt_history_segment written;
+  std::size_t journaled = 0;
+  for (std::size_t i = 0; i < records.size(); i++) {
+    written.append(records[i]);
+    if (i % 7 == 0 || i + 1 == records.size()) {
+      TTT_CHECK(written.append_journal(path, journaled));
+      journaled = written.size();
+    }
+  }
+
+  ttt_history_segment loaded;
+  TTT_CHECK(loaded.load(path));
+  TTT_CHECK(loaded.size() == records.size());
+  for (std::size_t i = 0; i < records.size(); i++) {
+    const auto& names = loaded.name_list();
+    TTT_CHECK(names[loaded.player_1_ids()[i]] == records[i].players[0]);
+    TTT_CHECK(names[loaded.player_2_ids()[i]] == records[i].players[1]);
+    TTT_CHECK(loaded.time_list()[i] == records[i].time_ms);
+    TTT_CHECK(loaded.move_list()[i] == records[i].moves);
+    TTT_CHECK(loaded.outcome_list()[i] == records[i].outcome);
+  }
+  if (records.size() >= 2) {
+    auto found = loaded.rows_of(loaded.player_1_ids()[0],
+                                loaded.player_2_ids()[0]);
+    TTT_CHECK(found.first != found.second && *found.first == 0);
+  }
+
+  const std::string bytes = read_file(path);
+  for (std::size_t cut = 1; cut < 20 && cut < bytes.size(); cut++) {
+    write_file(path, bytes.substr(0, bytes.size() - cut));
+    ttt_history_segment segment;
+    TTT_CHECK(segment.load(path));
+    TTT_CHECK(segment.size() == records.size() - 1);
+    check_bounds(segment);
+  }
+  std::remove(path.c_str());
+}
+
+//------------------------------------------------------------------------------
+
+int main() {
+  char dir[] = "/tmp/ttt_history_test.XXXXXX";
+  if (!::mkdtemp(dir)) {
+    std::cerr << "Can't create a temporary directory\n";
+    return 1;
+  }
+  const std::string path = std::string(dir) + "/seg-00000000.ttth";
+
+  int status = 0;
+  try {
+    std::mt19937 rng(0x5e9u);
+
+    // IDs in 2 bytes
+    check_round_trip(path, make_records(20000, make_players(300, "p-"), rng));
+
+    // Over 65535 names, so IDs take 4 bytes
+    check_round_trip(path,
+                     make_records(ttt_history_segment::max_rows,
+                                  make_players(100000, "player-"), rng));
+
+    // An empty segment is still a segment
+    check_round_trip(path, std::vector<ttt_game_record>());
+
+    // Small enough to break at every byte
+    check_round_trip(path, make_records(24, make_players(5, "q-"), rng));
+    check_truncation(path);
+    check_corruption(path);
+
+    // What the server writes while a segment fills up
+    check_journal(std::string(dir) + "/seg-00000001.tthj",
+                  make_records(500, make_players(5, "q-"), rng));
+
+    std::cout << "History segments: OK\n";
+  } catch (std::exception& e) {
+    std::cerr << "History segments: " << e.what() << "\n";
+    status = 1;
+  }
+
+  std::remove(path.c_str());
+  ::rmdir(dir);
+  return status;
+}
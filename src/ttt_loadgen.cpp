@@ -0,0 +1,656 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <unistd.h>
+#include "ttt_shared.hpp"
+#include "ttt_client_session.hpp"
+
+using boost::asio::ip::tcp;
+
+typedef std::chrono::steady_clock ttt_load_clock;
+
+//------------------------------------------------------------------------------
+
+/*
+** Cells taken on every move of the scripted game, whoever plays first.
+** It is a tie, so games always last the whole nine moves.
+*/
+static const int ttt_load_script[][2] = {{0, 0}, {1, 1}, {2, 2},
+                                         {0, 1}, {2, 1}, {2, 0},
+                                         {0, 2}, {1, 2}, {1, 0}};
+
+/*
+** What the load generator saw during the measured window
+*/
+struct ttt_load_stats {
+  bool measuring = false;
+  uint64_t moves = 0;
+  uint64_t games = 0;
+  std::vector<uint32_t> latencies_us;  // From a move to its update
+};
+
+//------------------------------------------------------------------------------
+
+class ttt_load_room;
+
+/*
+** One of the two players of a load room. It makes the scripted move
+** whenever it is its turn, and times how long the update takes.
+*/
+class ttt_load_session : public ttt_client_base<tcp> {
+ public:
+  ttt_load_session(boost::asio::io_service& io_service,
+                   const std::vector<tcp::endpoint>& endpoints,
+                   const ttt_join_message& join, ttt_load_room& room)
+      : ttt_client_base<tcp>(io_service, endpoints, join), room_(room) {}
+
+  /*
+  ** Sends a move and starts its clock
+  */
+  void move(int x, int y) {
+    sent_ = ttt_load_clock::now();
+    pending_ = true;
+    take(x, y);
+  }
+
+ protected:
+  void on_message_received(const ttt_message& msg) override;
+
+  void on_server_disconnection() override;
+
+  void log(const std::string& /*msg*/) const override {}
+
+ private:
+  ttt_load_room& room_;
+  ttt_load_clock::time_point sent_;
+  bool pending_ = false;  // Waiting for the update of our move?
+};
+
+//------------------------------------------------------------------------------
+
+/*
+** Plays the scripted game in a room, over and over, with fresh
+** connections every time like real players would. When a game never
+** got going, as when the server refused a connection, it tries again
+** a little later.
+*/
+class ttt_load_room {
+ public:
+  enum { retry_ms = 100 };
+
+  ttt_load_room(boost::asio::io_service& io_service,
+                const std::vector<tcp::endpoint>& endpoints,
+                const std::string& id, ttt_load_stats& stats)
+      : io_service_(io_service),
+        endpoints_(endpoints),
+        stats_(stats),
+        retry_timer_(io_service) {
+    join_.room = id;
+  }
+
+  void start() {
+    // Sessions of the last game go once their pending handlers are done
+    closed_ = 0;
+    updated_ = false;
+    for (auto& session : sessions_) {
+      session = ttt_start_session<ttt_load_session>(io_service_, endpoints_,
+                                                    join_, *this);
+    }
+  }
+
+  void on_update(ttt_load_session& session, const ttt_update_message& umsg,
+                 bool own_move, ttt_load_clock::duration latency) {
+    updated_ = true;
+    if (own_move && stats_.measuring) {
+      stats_.moves += 1;
+      stats_.latencies_us.push_back(
+          std::chrono::duration_cast<std::chrono::microseconds>(latency)
+              .count());
+    }
+
+    if (!umsg.playing || umsg.current_player != umsg.player_id) {
+      return;
+    }
+
+    unsigned taken = 0;
+    for (const auto& row : umsg.board) {
+      for (ttt_player_id cell : row) {
+        taken += (cell != ttt_player_id::none);
+      }
+    }
+    if (taken < sizeof(ttt_load_script) / sizeof(ttt_load_script[0])) {
+      session.move(ttt_load_script[taken][0], ttt_load_script[taken][1]);
+    }
+  }
+
+  /*
+  ** The server closes both players when a game ends; then a new one
+  ** starts
+  */
+  void on_closed() {
+    if (++closed_ < ttt_number_of_players) {
+      return;
+    }
+    if (!updated_) {
+      retry_timer_.expires_from_now(std::chrono::milliseconds(retry_ms));
+      retry_timer_.async_wait([this](boost::system::error_code ec) {
+        if (!ec) {
+          start();
+        }
+      });
+      return;
+    }
+    if (stats_.measuring) {
+      stats_.games += 1;
+    }
+    io_service_.post([this]() { start(); });
+  }
+
+ private:
+  boost::asio::io_service& io_service_;
+  std::vector<tcp::endpoint> endpoints_;
+  ttt_join_message join_;
+  ttt_load_stats& stats_;
+  std::shared_ptr<ttt_load_session> sessions_[ttt_number_of_players];
+  unsigned closed_ = 0;
+  bool updated_ = false;  // Did the server start the game?
+  boost::asio::steady_timer retry_timer_;
+};
+
+void ttt_load_session::on_message_received(const ttt_message& msg) {
+  ttt_update_message umsg;
+  if (!ttt_update_message::try_parse(msg, umsg)) {
+    return;
+  }
+
+  const bool own_move = pending_;
+  pending_ = false;
+  room_.on_update(*this, umsg, own_move, ttt_load_clock::now() - sent_);
+}
+
+void ttt_load_session::on_server_disconnection() { room_.on_closed(); }
+
+//------------------------------------------------------------------------------
+
+/*
+** A spectator that does nothing once it is in, to see what an idle
+** connection costs the server. Rooms without a game send spectators
+** nothing, so it is in once connected and its join is on the way.
+** It tells whether it got in or not, once.
+*/
+class ttt_idle_session : public ttt_client_base<tcp> {
+ public:
+  typedef std::function<void(bool in)> settled_func;
+
+  ttt_idle_session(boost::asio::io_service& io_service,
+                   const std::vector<tcp::endpoint>& endpoints,
+                   const ttt_join_message& join, settled_func on_settled)
+      : ttt_client_base<tcp>(io_service, endpoints, join),
+        on_settled_(std::move(on_settled)) {}
+
+ protected:
+  void on_server_connection() override { settle(true); }
+
+  void on_server_disconnection() override { settle(false); }
+
+  void log(const std::string& /*msg*/) const override {}
+
+ private:
+  void settle(bool in) {
+    if (!settled_) {
+      settled_ = true;
+      on_settled_(in);
+    }
+  }
+
+  settled_func on_settled_;
+  bool settled_ = false;
+};
+
+//------------------------------------------------------------------------------
+
+/*
+** CPU time and memory of another process, from /proc
+*/
+struct ttt_process_usage {
+  double cpu_seconds = 0;
+  uint64_t rss_kb = 0;
+  uint64_t peak_rss_kb = 0;
+
+  static ttt_process_usage of(long pid) {
+    ttt_process_usage usage;
+    const std::string dir = "/proc/" + std::to_string(pid);
+
+    std::ifstream stat_file(dir + "/stat");
+    std::string stat((std::istreambuf_iterator<char>(stat_file)),
+                     std::istreambuf_iterator<char>());
+    const std::size_t name_end = stat.rfind(')');
+    if (name_end == std::string::npos || name_end + 2 > stat.size()) {
+      throw std::runtime_error("Can't read " + dir + "/stat, is process " +
+                               std::to_string(pid) + " gone?");
+    }
+    // Fields after the command name, which may have spaces in it
+    std::istringstream fields(stat.substr(name_end + 2));
+    std::string field;
+    unsigned long utime = 0, stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; i++) {
+      if (i == 14) {
+        utime = std::strtoul(field.c_str(), nullptr, 10);
+      } else if (i == 15) {
+        stime = std::strtoul(field.c_str(), nullptr, 10);
+      }
+    }
+    usage.cpu_seconds = double(utime + stime) / ::sysconf(_SC_CLK_TCK);
+
+    std::ifstream status(dir + "/status");
+    for (std::string line; std::getline(status, line);) {
+      if (line.compare(0, 6, "VmRSS:") == 0) {
+        usage.rss_kb = std::strtoull(line.c_str() + 6, nullptr, 10);
+      } else if (line.compare(0, 6, "VmHWM:") == 0) {
+        usage.peak_rss_kb = std::strtoull(line.c_str() + 6, nullptr, 10);
+      }
+    }
+    return usage;
+  }
+};
+
+//------------------------------------------------------------------------------
+
+/*
+** Opens idle spectator connections and measures how much the server's
+** RSS grows for each one, once every connection got in or failed.
+** Connections that fail are left out; it gives up waiting after
+** 'patience_seconds'.
+*/
+class ttt_idle_probe {
+ public:
+  enum { spectators_per_room = 64 };  // The most a room lets in
+  enum { settle_ms = 500 };
+  enum { patience_seconds = 10 };
+
+  typedef std::function<void(double)> done_func;  // Bytes per connection
+
+  ttt_idle_probe(boost::asio::io_service& io_service,
+                 const std::vector<tcp::endpoint>& endpoints,
+                 long server_pid, unsigned n_connections, done_func done)
+      : io_service_(io_service),
+        endpoints_(endpoints),
+        server_pid_(server_pid),
+        n_connections_(n_connections),
+        timer_(io_service),
+        done_(std::move(done)) {}
+
+  void start() {
+    rss_before_kb_ = ttt_process_usage::of(server_pid_).rss_kb;
+
+    ttt_join_message join;
+    join.spectate = true;
+    for (unsigned i = 0; i < n_connections_; i++) {
+      join.room = "idle-" + std::to_string(i / spectators_per_room);
+      sessions_.push_back(ttt_start_session<ttt_idle_session>(
+          io_service_, endpoints_, join,
+          [this](bool in) { on_settled(in); }));
+    }
+
+    timer_.expires_from_now(std::chrono::seconds(patience_seconds));
+    timer_.async_wait([this](boost::system::error_code ec) {
+      if (!ec) {
+        measure();
+      }
+    });
+  }
+
+ private:
+  void on_settled(bool in) {
+    (in ? in_ : failed_) += 1;
+    if (measured_ || in_ + failed_ < n_connections_) {
+      return;
+    }
+    // Let the server seat them before looking
+    timer_.expires_from_now(std::chrono::milliseconds(settle_ms));
+    timer_.async_wait([this](boost::system::error_code ec) {
+      if (!ec) {
+        measure();
+      }
+    });
+  }
+
+  void measure() {
+    measured_ = true;  // Closing the sessions below settles the rest
+    const uint64_t rss_after_kb = ttt_process_usage::of(server_pid_).rss_kb;
+    for (auto& session : sessions_) {
+      session->close();
+    }
+    sessions_.clear();
+
+    const double grown = 1024.0 * (rss_after_kb > rss_before_kb_
+                                       ? rss_after_kb - rss_before_kb_
+                                       : 0);
+    done_(in_ ? grown / in_ : 0);
+  }
+
+ private:
+  boost::asio::io_service& io_service_;
+  std::vector<tcp::endpoint> endpoints_;
+  long server_pid_;
+  unsigned n_connections_;
+  boost::asio::steady_timer timer_;
+  done_func done_;
+  std::vector<std::shared_ptr<ttt_idle_session>> sessions_;
+  uint64_t rss_before_kb_ = 0;
+  unsigned in_ = 0;
+  unsigned failed_ = 0;
+  bool measured_ = false;
+};
+
+//------------------------------------------------------------------------------
+
+/*
+** A measured value, and which way it regresses
+*/
+struct ttt_metric {
+  std::string name;
+  double value;
+  bool higher_is_better;
+  double tolerance;  // Least fraction it may get worse by before failing
+  double spread;     // (max - min) / median over the runs, 0 if unknown
+};
+
+/*
+** Metrics of a window that lasted 'seconds', as measured
+*/
+std::vector<ttt_metric> collect_metrics(ttt_load_stats& stats, double seconds,
+                                        const ttt_process_usage& begin,
+                                        const ttt_process_usage& end,
+                                        bool have_server) {
+  std::vector<uint32_t>& l = stats.latencies_us;
+  std::sort(l.begin(), l.end());
+  auto percentile = [&l](double p) -> double {
+    return (l.empty() ? 0 : l[std::min<std::size_t>(l.size() - 1,
+                                                    l.size() * p / 100)]);
+  };
+
+  std::vector<ttt_metric> metrics = {
+      {"moves_per_second", stats.moves / seconds, true, 0.05},
+      {"games_per_second", stats.games / seconds, true, 0.05},
+      // Tail latencies are the noisiest, and get the most slack
+      {"latency_p50_us", percentile(50), false, 0.1},
+      {"latency_p90_us", percentile(90), false, 0.15},
+      {"latency_p99_us", percentile(99), false, 0.2}};
+  if (have_server) {
+    metrics.push_back({"server_peak_rss_kb", double(end.peak_rss_kb), false,
+                       0.05});
+    metrics.push_back(
+        {"server_cpu_us_per_move",
+         (stats.moves ? 1e6 * (end.cpu_seconds - begin.cpu_seconds) /
+                            stats.moves
+                      : 0),
+         false, 0.1});
+  }
+  return metrics;
+}
+
+/*
+** Median of every metric over the runs, so that a run disturbed by
+** something else on the machine counts no more than any other, and
+** how far apart the runs were
+*/
+std::vector<ttt_metric> median_metrics(
+    const std::vector<std::vector<ttt_metric>>& runs) {
+  std::vector<ttt_metric> median = runs.front();
+  for (std::size_t i = 0; i < median.size(); i++) {
+    std::vector<double> values;
+    for (const auto& run : runs) {
+      values.push_back(run[i].value);
+    }
+    std::sort(values.begin(), values.end());
+    const std::size_t middle = values.size() / 2;
+    median[i].value = (values.size() % 2
+                           ? values[middle]
+                           : (values[middle - 1] + values[middle]) / 2);
+    if (median[i].value != 0) {
+      median[i].spread = (values.back() - values.front()) / median[i].value;
+    }
+  }
+  return median;
+}
+
+/*
+** Writes the metrics as a flat JSON object, each followed by its spread
+** as "<name>_spread" when it has one
+*/
+void write_metrics(std::ostream& os, const std::vector<ttt_metric>& metrics) {
+  os << "{\n" << std::fixed;
+  for (std::size_t i = 0; i < metrics.size(); i++) {
+    const ttt_metric& m = metrics[i];
+    os << "  \"" << m.name << "\": " << std::setprecision(1) << m.value;
+    if (m.spread > 0) {
+      os << ",\n  \"" << m.name << "_spread\": " << std::setprecision(3)
+         << m.spread;
+    }
+    os << (i + 1 < metrics.size() ? ",\n" : "\n");
+  }
+  os << "}\n";
+}
+
+/*
+** Reads the numbers of a flat JSON object, as written by 'write_metrics'
+*/
+std::map<std::string, double> read_metrics(const std::string& path) {
+  std::ifstream file(path);
+  if (!file) {
+    throw std::runtime_error("Can't read '" + path + "'");
+  }
+  std::string text((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+
+  std::map<std::string, double> values;
+  for (std::size_t pos = 0;
+       (pos = text.find('"', pos)) != std::string::npos;) {
+    const std::size_t end = text.find('"', pos + 1);
+    const std::size_t colon = text.find(':', end);
+    if (end == std::string::npos || colon == std::string::npos) {
+      break;
+    }
+    values[text.substr(pos + 1, end - pos - 1)] =
+        std::strtod(text.c_str() + colon + 1, nullptr);
+    pos = colon;
+  }
+  return values;
+}
+
+/*
+** Checks every metric against the baseline. Returns false on any
+** regression beyond its tolerance: twice the spread the baseline runs
+** had, but never less than the metric's own.
+*/
+bool compare_metrics(const std::vector<ttt_metric>& metrics,
+                     const std::map<std::string, double>& baseline) {
+  bool ok = true;
+  std::cerr << std::fixed << std::setprecision(1);
+  for (const auto& m : metrics) {
+    auto it = baseline.find(m.name);
+    if (it == baseline.end() || it->second == 0) {
+      std::cerr << std::left << std::setw(34) << m.name << std::right
+                << std::setw(12) << m.value << "  (no baseline)\n";
+      continue;
+    }
+
+    auto spread = baseline.find(m.name + "_spread");
+    const double tolerance =
+        std::max(m.tolerance,
+                 spread == baseline.end() ? 0.0 : 2 * spread->second);
+    const double change = (m.value - it->second) / it->second;
+    const double worse = (m.higher_is_better ? -change : change);
+    const bool regressed = worse > tolerance;
+    ok = ok && !regressed;
+
+    std::cerr << std::left << std::setw(34) << m.name << std::right
+              << std::setw(12) << m.value << "  baseline " << std::setw(12)
+              << it->second << "  " << std::showpos << 100 * change
+              << std::noshowpos << "%";
+    if (regressed) {
+      std::cerr << "  REGRESSION (tolerance " << int(100 * tolerance)
+                << "%)";
+    }
+    std::cerr << "\n";
+  }
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[]) {
+  try {
+    if (argc < 3) {
+      std::cerr << "Usage: loadgen <host> <port> [--rooms <N>] "
+                   "[--warmup <seconds>] [--seconds <seconds>]\n"
+                   "               [--runs <N>] [--server-pid <pid>] "
+                   "[--idle <N>] [--baseline <file>]\n"
+                   "Plays a scripted game in N rooms of a room server, over "
+                   "and over, and prints\n"
+                   "throughput, latency and server usage as JSON, the "
+                   "median over all runs. With a\n"
+                   "server PID and --idle, it first measures the server's "
+                   "RSS per idle connection\n"
+                   "over N of them. With a baseline, exits with 1 if any "
+                   "metric regressed beyond\n"
+                   "its tolerance.\n";
+      return 1;
+    }
+
+    unsigned n_rooms = 64;
+    double warmup = 2, seconds = 10;
+    unsigned runs = 1;
+    unsigned n_idle = 0;
+    long server_pid = 0;
+    std::string baseline;
+    for (int i = 3; i + 1 < argc; i += 2) {
+      const std::string option = argv[i];
+      if (option == "--rooms") {
+        n_rooms = std::atoi(argv[i + 1]);
+      } else if (option == "--warmup") {
+        warmup = std::atof(argv[i + 1]);
+      } else if (option == "--seconds") {
+        seconds = std::atof(argv[i + 1]);
+      } else if (option == "--runs") {
+        runs = std::max(1, std::atoi(argv[i + 1]));
+      } else if (option == "--idle") {
+        n_idle = std::atoi(argv[i + 1]);
+      } else if (option == "--server-pid") {
+        server_pid = std::atol(argv[i + 1]);
+      } else if (option == "--baseline") {
+        baseline = argv[i + 1];
+      } else {
+        std::cerr << "Unknown option '" << option << "'\n";
+        return 1;
+      }
+    }
+
+    if (server_pid &&
+        ::access(("/proc/" + std::to_string(server_pid)).c_str(), F_OK) !=
+            0) {
+      std::cerr << "No process " << server_pid << " to measure\n";
+      return 1;
+    }
+
+    boost::asio::io_service io_service;
+
+    tcp::resolver resolver(io_service);
+    tcp::resolver::iterator it = resolver.resolve({argv[1], argv[2]}), end;
+    std::vector<tcp::endpoint> endpoints(it, end);
+
+    // Idle connections are measured first, on a quiet server, and
+    // closed before the load starts
+    double idle_connection_bytes = 0;
+    if (server_pid && n_idle) {
+      ttt_idle_probe probe(io_service, endpoints, server_pid, n_idle,
+                           [&](double bytes) {
+                             idle_connection_bytes = bytes;
+                             io_service.stop();
+                           });
+      probe.start();
+      io_service.run();
+      io_service.reset();
+    }
+
+    ttt_load_stats stats;
+    std::vector<std::unique_ptr<ttt_load_room>> rooms;
+    for (unsigned i = 0; i < n_rooms; i++) {
+      rooms.emplace_back(new ttt_load_room(
+          io_service, endpoints, "load-" + std::to_string(i), stats));
+      rooms.back()->start();
+    }
+
+    // Measure only once every room is up and running, then in back to
+    // back windows, timed as they really went
+    std::vector<std::vector<ttt_metric>> windows;
+    ttt_process_usage usage_begin;
+    ttt_load_clock::time_point window_begin;
+    auto to_duration = [](double s) {
+      return std::chrono::milliseconds(static_cast<long long>(s * 1000));
+    };
+    boost::asio::steady_timer timer(io_service);
+    std::function<void(boost::system::error_code)> next_window =
+        [&](boost::system::error_code) {
+          const ttt_load_clock::time_point now = ttt_load_clock::now();
+          ttt_process_usage usage;
+          if (server_pid) {
+            usage = ttt_process_usage::of(server_pid);
+          }
+          if (stats.measuring) {
+            const double elapsed =
+                std::chrono::duration<double>(now - window_begin).count();
+            windows.push_back(collect_metrics(stats, elapsed, usage_begin,
+                                              usage, server_pid != 0));
+            if (windows.size() == runs) {
+              io_service.stop();
+              return;
+            }
+          }
+          stats = ttt_load_stats();
+          stats.measuring = true;
+          usage_begin = usage;
+          window_begin = now;
+
+          timer.expires_from_now(to_duration(seconds));
+          timer.async_wait(next_window);
+        };
+    timer.expires_from_now(to_duration(warmup));
+    timer.async_wait(next_window);
+
+    io_service.run();
+
+    std::vector<ttt_metric> metrics = median_metrics(windows);
+    if (server_pid && n_idle) {
+      metrics.push_back({"server_bytes_per_idle_connection",
+                         idle_connection_bytes, false, 0.1});
+    }
+    write_metrics(std::cout, metrics);
+
+    if (!baseline.empty() &&
+        !compare_metrics(metrics, read_metrics(baseline))) {
+      return 1;
+    }
+  } catch (std::exception& e) {
+    std::cerr << "Exception: " << e.what() << "\n";
+    return 1;
+  }
+
+  return 0;
+}
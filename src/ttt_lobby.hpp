@@ -0,0 +1,209 @@
+#ifndef ttt_lobby_hpp
+#define ttt_lobby_hpp
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ttt_shared.hpp"
+
+//----------------------------------------------------------------------
+
+/*
+** What the lobby shows about a room
+*/
+struct ttt_room_info {
+  int players = 0;
+  int spectators = 0;
+  bool playing = false;
+
+  bool operator==(const ttt_room_info& other) const {
+    return players == other.players && spectators == other.spectators &&
+           playing == other.playing;
+  }
+
+  bool operator!=(const ttt_room_info& other) const {
+    return !(*this == other);
+  }
+};
+
+/*
+** Something told about every change to a room index
+*/
+class ttt_lobby_listener {
+ public:
+  virtual ~ttt_lobby_listener() {}
+  virtual void on_lobby_event(const ttt_lobby_message& lmsg) = 0;
+};
+
+//----------------------------------------------------------------------
+
+/*
+** Rooms of a server, for the lobby. Every change bumps the version of
+** the index and is kept in a bounded history, so subscribers coming
+** back with a version they saw only get what changed since then.
+** Versions start over with every index, which gets a new epoch, so
+** versions from before a restart are never taken for current ones.
+** Listings are read from snapshots, each one the rooms as they were
+** at a version, so subscribers can stream tens of thousands of rooms
+** at the pace of their connection, and then catch up from there.
+*/
+class ttt_room_index {
+ public:
+  typedef std::map<std::string, ttt_room_info> room_map;
+  typedef std::shared_ptr<const room_map> snapshot_ptr;
+
+  enum { history_length = 4096 };
+
+  ttt_room_index() : epoch_(new_epoch()) {}
+
+  uint64_t epoch() const { return epoch_; }
+
+  uint64_t version() const { return version_; }
+
+  std::size_t size() const { return rooms_.size(); }
+
+  /*
+  ** Adds a room, or updates it if it changed
+  */
+  void update(const std::string& room, const ttt_room_info& info) {
+    auto it = rooms_.find(room);
+    ttt_lobby_event event = ttt_lobby_event::update;
+    if (it == rooms_.end()) {
+      rooms_.insert(std::make_pair(room, info));
+      event = ttt_lobby_event::add;
+    } else if (it->second != info) {
+      it->second = info;
+    } else {
+      return;  // Nothing new
+    }
+
+    publish(event_for(event, room, info));
+  }
+
+  void remove(const std::string& room) {
+    if (rooms_.erase(room) != 0) {
+      publish(event_for(ttt_lobby_event::remove, room, ttt_room_info()));
+    }
+  }
+
+  /*
+  ** Gets the changes made after version 'since' of 'epoch'. Returns
+  ** false if some of them were forgotten, or the version is from
+  ** another index, so a full listing is needed.
+  */
+  bool events_since(uint64_t epoch, uint64_t since,
+                    std::vector<ttt_lobby_message>& events) const {
+    if (epoch != epoch_ || since > version_) {
+      return false;  // From another server, or from before a restart
+    }
+    if (since < version_ - history_.size()) {
+      return false;
+    }
+
+    events.insert(events.end(), history_.end() - (version_ - since),
+                  history_.end());
+    return true;
+  }
+
+  /*
+  ** The rooms as they are at the current version. Never changes, and
+  ** is shared by every listing started at the same version.
+  */
+  snapshot_ptr snapshot() {
+    snapshot_ptr last = snapshot_.lock();
+    if (!last || snapshot_version_ != version_) {
+      last = std::make_shared<const room_map>(rooms_);
+      snapshot_ = last;
+      snapshot_version_ = version_;
+    }
+    return last;
+  }
+
+  /*
+  ** Gets up to 'n' rooms of 'rooms' as 'add' events of 'version', in
+  ** ID order, starting right after room 'after' (or at the first room,
+  ** if empty). Returns true once the listing is complete.
+  */
+  bool listing(const room_map& rooms, uint64_t version,
+               const std::string& after, std::size_t n,
+               std::vector<ttt_lobby_message>& events) const {
+    auto it = (after.empty() ? rooms.begin() : rooms.upper_bound(after));
+    for (; it != rooms.end() && n > 0; ++it, --n) {
+      events.push_back(
+          event_for(ttt_lobby_event::add, it->first, it->second));
+      events.back().version = version;
+    }
+    return it == rooms.end();
+  }
+
+  void subscribe(ttt_lobby_listener* listener) {
+    listeners_.push_back(listener);
+  }
+
+  void unsubscribe(ttt_lobby_listener* listener) {
+    listeners_.erase(
+        std::remove(listeners_.begin(), listeners_.end(), listener),
+        listeners_.end());
+  }
+
+ private:
+  /*
+  ** Tells server runs apart, even on the same host in the same second.
+  ** Never zero, which subscribers send when they have seen nothing.
+  */
+  static uint64_t new_epoch() {
+    std::random_device device;
+    const uint64_t epoch =
+        (uint64_t(device()) << 32 | device()) ^
+        uint64_t(std::chrono::system_clock::now().time_since_epoch().count());
+    return (epoch != 0 ? epoch : 1);
+  }
+
+  ttt_lobby_message event_for(ttt_lobby_event event, const std::string& room,
+                              const ttt_room_info& info) const {
+    ttt_lobby_message lmsg;
+    lmsg.epoch = epoch_;
+    lmsg.version = version_;
+    lmsg.event = event;
+    lmsg.room = room;
+    lmsg.players = info.players;
+    lmsg.spectators = info.spectators;
+    lmsg.playing = info.playing;
+    return lmsg;
+  }
+
+  void publish(ttt_lobby_message lmsg) {
+    lmsg.version = ++version_;
+
+    history_.push_back(lmsg);
+    if (history_.size() > history_length) {
+      history_.pop_front();
+    }
+
+    // Listeners may unsubscribe while being told
+    std::vector<ttt_lobby_listener*> listeners(listeners_);
+    for (ttt_lobby_listener* listener : listeners) {
+      listener->on_lobby_event(lmsg);
+    }
+  }
+
+ private:
+  room_map rooms_;
+  std::deque<ttt_lobby_message> history_;   // Last changes, oldest first
+  std::weak_ptr<const room_map> snapshot_;  // Last one, while listed
+  uint64_t snapshot_version_ = 0;
+  std::vector<ttt_lobby_listener*> listeners_;
+  uint64_t epoch_;
+  uint64_t version_ = 0;
+};
+
+//----------------------------------------------------------------------
+
+#endif  // ttt_lobby_hpp
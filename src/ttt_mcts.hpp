@@ -0,0 +1,430 @@
+#ifndef ttt_mcts_hpp
+#define ttt_mcts_hpp
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ttt_shared.hpp"
+#include "ttt_game_state.hpp"
+
+//----------------------------------------------------------------------
+
+/*
+** A position as one bit mask of taken cells per player, with the lines
+** through every cell precomputed. Winning takes a full row, column or
+** diagonal, as in 'ttt_game_state'.
+*/
+class ttt_bitboard {
+ public:
+  static_assert(ttt_number_of_cells <= 64, "Cells must fit in a mask");
+
+  ttt_bitboard(const ttt_board& board, ttt_player_id to_move)
+      : to_move_((int)to_move) {
+    for (int i = 0; i < ttt_number_of_cells; i++) {
+      const ttt_player_id who = board[i / ttt_board_side][i % ttt_board_side];
+      if (who != ttt_player_id::none) {
+        taken_[(int)who] |= uint64_t(1) << i;
+      }
+    }
+  }
+
+  int to_move() const { return to_move_; }
+
+  uint64_t empty() const {
+    return all_cells() & ~(taken_[0] | taken_[1]);
+  }
+
+  /*
+  ** Takes 'cell' for the player to move. Returns true if it wins.
+  */
+  bool play(unsigned cell) {
+    uint64_t& mine = taken_[to_move_];
+    mine |= uint64_t(1) << cell;
+    to_move_ ^= 1;
+
+    for (uint64_t line : lines().through[cell]) {
+      if ((mine & line) == line) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static uint64_t all_cells() {
+    return (ttt_number_of_cells == 64 ? ~uint64_t(0)
+                                      : (uint64_t(1) << ttt_number_of_cells) -
+                                            1);
+  }
+
+ private:
+  struct line_table {
+    std::vector<uint64_t> through[ttt_number_of_cells];
+
+    line_table() {
+      std::vector<uint64_t> all;
+      uint64_t diagonal = 0, anti_diagonal = 0;
+      for (int i = 0; i < ttt_board_side; i++) {
+        uint64_t row = 0, column = 0;
+        for (int j = 0; j < ttt_board_side; j++) {
+          row |= uint64_t(1) << (i * ttt_board_side + j);
+          column |= uint64_t(1) << (j * ttt_board_side + i);
+        }
+        all.push_back(row);
+        all.push_back(column);
+        diagonal |= uint64_t(1) << (i * ttt_board_side + i);
+        anti_diagonal |= uint64_t(1)
+                         << (i * ttt_board_side + ttt_board_side - 1 - i);
+      }
+      all.push_back(diagonal);
+      all.push_back(anti_diagonal);
+
+      for (int cell = 0; cell < ttt_number_of_cells; cell++) {
+        for (uint64_t line : all) {
+          if (line & (uint64_t(1) << cell)) {
+            through[cell].push_back(line);
+          }
+        }
+      }
+    }
+  };
+
+  static const line_table& lines() {
+    static const line_table table;
+    return table;
+  }
+
+ private:
+  uint64_t taken_[ttt_number_of_players] = {0, 0};
+  int to_move_;
+};
+
+//----------------------------------------------------------------------
+
+/*
+** Monte Carlo Tree Search with tree parallelism: every thread walks
+** the same tree, picking children by UCT, and plays random games from
+** the leaves it reaches. Node statistics are atomics, so no thread
+** ever waits for another. Each visit counts as a loss until its result
+** is backed up (virtual loss), which spreads threads over different
+** branches. Nodes come from an arena that is reused by every search,
+** and helper threads are started once, to wait for the next search.
+**
+** A single search runs at a time; the engine belongs to its caller,
+** whose thread takes part in every search.
+*/
+class ttt_mcts {
+ public:
+  typedef std::chrono::steady_clock clock;
+
+  enum { default_nodes = 1 << 20 };
+
+  struct stats {
+    uint64_t iterations = 0;
+    std::size_t nodes = 0;  // Arena nodes used
+  };
+
+  explicit ttt_mcts(unsigned threads = std::thread::hardware_concurrency(),
+                    std::size_t max_nodes = default_nodes,
+                    double exploration = 1.4)
+      : threads_(threads ? threads : 1),
+        capacity_(max_nodes),
+        exploration_(exploration),
+        nodes_(new node[max_nodes]) {
+    for (unsigned i = 1; i < threads_; i++) {
+      helpers_.emplace_back([this, i]() { help(i); });
+    }
+  }
+
+  ttt_mcts(const ttt_mcts&) = delete;
+  ttt_mcts& operator=(const ttt_mcts&) = delete;
+
+  ~ttt_mcts() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& helper : helpers_) {
+      helper.join();
+    }
+  }
+
+  /*
+  ** Picks a cell (x * side + y) for 'to_move', searching until
+  ** 'deadline' or for 'max_iterations'. Past the deadline already, it
+  ** returns the first empty cell. Returns -1 if the board is full.
+  */
+  int search(const ttt_board& board, ttt_player_id to_move,
+             clock::time_point deadline,
+             uint64_t max_iterations = std::numeric_limits<uint64_t>::max(),
+             stats* out = nullptr) {
+    const ttt_bitboard root_position(board, to_move);
+    if (!root_position.empty()) {
+      return -1;
+    }
+
+    // Recycle the whole arena: node 0 is the root
+    used_ = 1;
+    init(nodes_[0], 0);
+    expand(nodes_[0], root_position);
+
+    std::atomic<uint64_t> started(0);
+    std::atomic<uint64_t> iterations(0);
+    auto work = [&](unsigned seed) {
+      uint64_t rng = 0x9e3779b97f4a7c15ull * (seed + 1);
+      uint64_t n = 0;
+      for (;; n++) {
+        const uint64_t ticket = started.fetch_add(1);
+        if (ticket >= max_iterations) {
+          break;
+        }
+        // Only look at the clock every few playouts
+        if (n % 16 == 0 && clock::now() >= deadline) {
+          break;
+        }
+        iterate(root_position, rng);
+      }
+      iterations += n;
+    };
+
+    const std::function<void(unsigned)> job(work);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job_ = &job;
+      searches_ += 1;
+      busy_ = helpers_.size();
+    }
+    wake_.notify_all();
+    work(0);
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [this]() { return busy_ == 0; });
+      job_ = nullptr;
+    }
+
+    // The most visited move is the most trusted one
+    const node& root = nodes_[0];
+    const node* best = nullptr;
+    for (unsigned i = 0; i < root.n_children; i++) {
+      const node& child = nodes_[root.first_child + i];
+      if (!best || child.visits > best->visits) {
+        best = &child;
+      }
+    }
+
+    if (out) {
+      out->iterations = iterations;
+      out->nodes = std::min<std::size_t>(used_, capacity_);
+    }
+    return best->cell;
+  }
+
+ private:
+  /*
+  ** Helper thread 'seed': takes part in every search, until destroyed
+  */
+  void help(unsigned seed) {
+    uint64_t searches = 0;
+    for (;;) {
+      const std::function<void(unsigned)>* job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this, searches]() {
+          return stopping_ || searches_ != searches;
+        });
+        if (stopping_) {
+          return;
+        }
+        searches = searches_;
+        job = job_;
+      }
+
+      (*job)(seed);
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--busy_ == 0) {
+        done_.notify_one();
+      }
+    }
+  }
+
+  enum : uint8_t { leaf, expanding, expanded };
+
+  struct node {
+    std::atomic<uint32_t> visits;  // Including those still in flight
+    std::atomic<uint32_t> score;   // Half points of the player moving here
+    std::atomic<uint8_t> state;
+    uint8_t cell;
+    uint8_t n_children;
+    uint32_t first_child;  // Valid once 'expanded'
+  };
+
+  static void init(node& n, unsigned cell) {
+    n.visits.store(0, std::memory_order_relaxed);
+    n.score.store(0, std::memory_order_relaxed);
+    n.state.store(leaf, std::memory_order_relaxed);
+    n.cell = cell;
+    n.n_children = 0;
+    n.first_child = 0;
+  }
+
+  /*
+  ** Gives 'n' a child per empty cell, unless another thread is at it or
+  ** the arena is exhausted. Returns true if 'n' has children.
+  */
+  bool expand(node& n, const ttt_bitboard& position) {
+    uint8_t state = leaf;
+    if (!n.state.compare_exchange_strong(state, expanding)) {
+      return state == expanded;
+    }
+
+    uint64_t empty = position.empty();
+    const unsigned count = __builtin_popcountll(empty);
+    const std::size_t first = used_.fetch_add(count);
+    if (first + count > capacity_) {
+      n.state.store(leaf, std::memory_order_release);  // Stays a leaf
+      return false;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+      init(nodes_[first + i], __builtin_ctzll(empty));
+      empty &= empty - 1;
+    }
+    n.first_child = first;
+    n.n_children = count;
+    n.state.store(expanded, std::memory_order_release);
+    return true;
+  }
+
+  /*
+  ** Child of 'parent' with the best upper confidence bound, for the
+  ** player choosing at 'parent'
+  */
+  node& select(const node& parent) {
+    const double log_visits =
+        std::log(double(parent.visits.load(std::memory_order_relaxed)) + 1);
+    node* best = nullptr;
+    double best_value = -1;
+    for (unsigned i = 0; i < parent.n_children; i++) {
+      node& child = nodes_[parent.first_child + i];
+      const uint32_t visits = child.visits.load(std::memory_order_relaxed);
+      if (visits == 0) {
+        return child;
+      }
+      const double mean =
+          child.score.load(std::memory_order_relaxed) / (2.0 * visits);
+      const double value =
+          mean + exploration_ * std::sqrt(log_visits / visits);
+      if (value > best_value) {
+        best_value = value;
+        best = &child;
+      }
+    }
+    return *best;
+  }
+
+  /*
+  ** One playout: down the tree, then at random to the end of the game,
+  ** then the result back up the path
+  */
+  void iterate(ttt_bitboard position, uint64_t& rng) {
+    node* path[ttt_number_of_cells + 1];
+    int movers[ttt_number_of_cells + 1];
+    unsigned depth = 0;
+
+    node* n = &nodes_[0];
+    n->visits.fetch_add(1, std::memory_order_relaxed);
+    path[depth] = n;
+    movers[depth++] = -1;
+
+    int winner = -1;
+    bool over = false;
+    for (;;) {
+      if (n->state.load(std::memory_order_acquire) != expanded) {
+        // Grow the tree by a level where it was visited before
+        if (n->visits.load(std::memory_order_relaxed) < 2 ||
+            !expand(*n, position)) {
+          break;
+        }
+      }
+
+      n = &select(*n);
+      n->visits.fetch_add(1, std::memory_order_relaxed);  // Virtual loss
+      const int mover = position.to_move();
+      path[depth] = n;
+      movers[depth++] = mover;
+
+      if (position.play(n->cell)) {
+        winner = mover;
+        over = true;
+        break;
+      }
+      if (!position.empty()) {
+        over = true;
+        break;
+      }
+    }
+
+    if (!over) {
+      winner = rollout(position, rng);
+    }
+
+    for (unsigned i = 1; i < depth; i++) {
+      const uint32_t points = (winner < 0 ? 1 : (winner == movers[i] ? 2 : 0));
+      path[i]->score.fetch_add(points, std::memory_order_relaxed);
+    }
+  }
+
+  /*
+  ** Plays random moves to the end. Returns the winner, or -1 for a tie.
+  */
+  static int rollout(ttt_bitboard& position, uint64_t& rng) {
+    for (uint64_t empty; (empty = position.empty()) != 0;) {
+      // xorshift64
+      rng ^= rng << 13;
+      rng ^= rng >> 7;
+      rng ^= rng << 17;
+
+      unsigned skip = rng % __builtin_popcountll(empty);
+      for (; skip > 0; skip--) {
+        empty &= empty - 1;
+      }
+
+      const int mover = position.to_move();
+      if (position.play(__builtin_ctzll(empty))) {
+        return mover;
+      }
+    }
+    return -1;
+  }
+
+ private:
+  unsigned threads_;
+  std::size_t capacity_;
+  double exploration_;
+  std::unique_ptr<node[]> nodes_;
+  std::atomic<std::size_t> used_{0};
+
+  std::vector<std::thread> helpers_;
+  std::mutex mutex_;
+  std::condition_variable wake_;  // A search started, or stopping
+  std::condition_variable done_;  // Every helper finished the search
+  const std::function<void(unsigned)>* job_ = nullptr;
+  uint64_t searches_ = 0;  // Started so far
+  std::size_t busy_ = 0;   // Helpers still in the current search
+  bool stopping_ = false;
+};
+
+//----------------------------------------------------------------------
+
+#endif  // ttt_mcts_hpp
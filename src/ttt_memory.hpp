@@ -0,0 +1,216 @@
+#ifndef ttt_memory_hpp
+#define ttt_memory_hpp
+
+#include <cassert>
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//----------------------------------------------------------------------
+
+/*
+** Hands out fixed-size blocks carved from large chunks. Blocks are
+** cache-line sized and aligned, so objects never share a line, and
+** freed blocks are reused as they are: a million connections cost a
+** million blocks, without per-allocation headers or fragmentation.
+** Chunks are only returned to the system on exit.
+**
+** Not thread safe: the slabs belong to the first thread that asks for
+** one, which is the one running the games, and only it may use them.
+** Debug builds check it on every call to 'for_size'.
+*/
+class ttt_slab {
+ public:
+  enum { cache_line = 64 };
+  enum { chunk_size = 64 * 1024 };
+  enum { max_block_size = 4 * 1024 };  // Larger blocks use operator new
+
+  /*
+  ** Returns the slab serving blocks of at least 'size' bytes
+  */
+  static ttt_slab& for_size(std::size_t size) {
+    static ttt_slab slabs[max_block_size / cache_line];
+    assert(on_owner_thread());
+    const std::size_t index = (size + cache_line - 1) / cache_line - 1;
+    ttt_slab& slab = slabs[index];
+    if (slab.block_size_ == 0) {
+      slab.block_size_ = (index + 1) * cache_line;
+    }
+    return slab;
+  }
+
+  static bool fits(std::size_t size) {
+    return size != 0 && size <= max_block_size;
+  }
+
+  std::size_t block_size() const { return block_size_; }
+
+  /*
+  ** Bytes taken from the system so far
+  */
+  std::size_t reserved() const { return chunks_.size() * chunk_size; }
+
+  void* allocate() {
+    if (!free_) {
+      grow();
+    }
+    free_block* block = free_;
+    free_ = block->next;
+    return block;
+  }
+
+  void deallocate(void* p) {
+    free_block* block = static_cast<free_block*>(p);
+    block->next = free_;
+    free_ = block;
+  }
+
+  ~ttt_slab() {
+    for (void* chunk : chunks_) {
+      std::free(chunk);
+    }
+  }
+
+ private:
+  static bool on_owner_thread() {
+    static const std::thread::id owner = std::this_thread::get_id();
+    return owner == std::this_thread::get_id();
+  }
+
+  struct free_block {
+    free_block* next;
+  };
+
+  void grow() {
+    void* chunk = nullptr;
+    if (::posix_memalign(&chunk, cache_line, chunk_size) != 0) {
+      throw std::bad_alloc();
+    }
+    chunks_.push_back(chunk);
+
+    char* p = static_cast<char*>(chunk);
+    for (std::size_t i = 0; i + block_size_ <= chunk_size; i += block_size_) {
+      deallocate(p + i);
+    }
+  }
+
+ private:
+  std::size_t block_size_ = 0;  // Set when first used
+  free_block* free_ = nullptr;
+  std::vector<void*> chunks_;
+};
+
+//----------------------------------------------------------------------
+
+/*
+** Standard allocator backed by slabs, for 'std::allocate_shared' and
+** containers of single nodes. Arrays and large objects fall back to
+** operator new.
+*/
+template <typename T>
+class ttt_slab_allocator {
+ public:
+  typedef T value_type;
+
+  ttt_slab_allocator() {}
+
+  template <typename U>
+  ttt_slab_allocator(const ttt_slab_allocator<U>&) {}
+
+  T* allocate(std::size_t n) {
+    if (n == 1 && ttt_slab::fits(sizeof(T))) {
+      return static_cast<T*>(ttt_slab::for_size(sizeof(T)).allocate());
+    }
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, std::size_t n) {
+    if (n == 1 && ttt_slab::fits(sizeof(T))) {
+      ttt_slab::for_size(sizeof(T)).deallocate(p);
+    } else {
+      ::operator delete(p);
+    }
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const ttt_slab_allocator<T>&, const ttt_slab_allocator<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const ttt_slab_allocator<T>&, const ttt_slab_allocator<U>&) {
+  return false;
+}
+
+//----------------------------------------------------------------------
+
+/*
+** Allocator that only remembers the size of what it was asked for,
+** to learn how big 'std::allocate_shared' blocks and container nodes
+** really are
+*/
+template <typename T>
+struct ttt_size_probe {
+  typedef T value_type;
+
+  explicit ttt_size_probe(std::size_t* size) : size_(size) {}
+
+  template <typename U>
+  ttt_size_probe(const ttt_size_probe<U>& other) : size_(other.size_) {}
+
+  T* allocate(std::size_t n) {
+    *size_ = n * sizeof(T);
+    return static_cast<T*>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, std::size_t) { ::operator delete(p); }
+
+  std::size_t* size_;
+};
+
+template <typename T, typename U>
+bool operator==(const ttt_size_probe<T>&, const ttt_size_probe<U>&) {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const ttt_size_probe<T>&, const ttt_size_probe<U>&) {
+  return false;
+}
+
+//----------------------------------------------------------------------
+
+/*
+** Owning pointer to a single object living in a slab
+*/
+template <typename T>
+struct ttt_slab_delete {
+  void operator()(T* p) const {
+    p->~T();
+    ttt_slab_allocator<T>().deallocate(p, 1);
+  }
+};
+
+template <typename T>
+using ttt_slab_ptr = std::unique_ptr<T, ttt_slab_delete<T>>;
+
+template <typename T, typename... Args>
+ttt_slab_ptr<T> ttt_slab_new(Args&&... args) {
+  T* p = ttt_slab_allocator<T>().allocate(1);
+  try {
+    new (p) T(std::forward<Args>(args)...);
+  } catch (...) {
+    ttt_slab_allocator<T>().deallocate(p, 1);
+    throw;
+  }
+  return ttt_slab_ptr<T>(p);
+}
+
+//----------------------------------------------------------------------
+
+#endif  // ttt_memory_hpp
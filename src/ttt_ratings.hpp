@@ -0,0 +1,210 @@
+#ifndef ttt_ratings_hpp
+#define ttt_ratings_hpp
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ttt_shared.hpp"
+#include "ttt_write_behind.hpp"
+
+//----------------------------------------------------------------------
+
+/*
+** Outcome of a finished game. Anonymous players have empty names. It is
+** a plain value, so it can go through a lock-free queue by copy.
+*/
+struct ttt_game_result {
+  enum { max_name = ttt_join_message::max_player_length + 1 };
+
+  char players[ttt_number_of_players][max_name];  // NUL-terminated
+  ttt_player_id winner;                           // 'none' for ties
+  bool rated;  // Only games between named people count for ratings
+};
+
+//----------------------------------------------------------------------
+
+struct ttt_rating {
+  double rating = 1500.0;
+  uint32_t wins = 0;
+  uint32_t losses = 0;
+  uint32_t draws = 0;
+};
+
+/*
+** Elo ratings of every player, kept in memory and written behind to a
+** compact file. Game results are queued by the game thread without
+** waiting; a background thread applies them in batches and saves the
+** table now and then, so storage never slows down a game. Only that
+** thread touches the table once it is loaded.
+**
+** File layout: "TTTR", a version byte, a record count (u32), then per
+** record a name length (u8), the name, the rating (f64) and the wins,
+** losses and draws (u32 each). Integers are little endian.
+*/
+class ttt_rating_store {
+ public:
+  enum { k_factor = 32 };
+  enum { queue_capacity = 4096 };
+  enum { batch_ms = 50 };
+  enum { flush_seconds = 5 };
+
+  explicit ttt_rating_store(const std::string& path)
+      : path_(path),
+        results_(std::chrono::milliseconds(batch_ms),
+                 std::chrono::seconds(flush_seconds)) {
+    load();
+    results_.start(
+        [this](const std::vector<ttt_game_result>& batch) { apply(batch); },
+        [this]() { return save(); });
+  }
+
+  ~ttt_rating_store() { results_.stop(); }
+
+  /*
+  ** Queues a result to be rated. Called from the game thread only;
+  ** it never waits for storage.
+  */
+  void submit(const ttt_game_result& result) { results_.submit(result); }
+
+ private:
+  /*
+  ** Applies a batch of results in order
+  */
+  void apply(const std::vector<ttt_game_result>& batch) {
+    for (const auto& result : batch) {
+      ttt_rating& a = table_[result.players[0]];
+      ttt_rating& b = table_[result.players[1]];
+
+      double score_a = 0.5;
+      if (result.winner == ttt_player_id::player_1) {
+        score_a = 1.0;
+      } else if (result.winner == ttt_player_id::player_2) {
+        score_a = 0.0;
+      }
+
+      const double expected_a =
+          1.0 / (1.0 + std::pow(10.0, (b.rating - a.rating) / 400.0));
+      const double delta = k_factor * (score_a - expected_a);
+      a.rating += delta;
+      b.rating -= delta;
+
+      if (score_a == 1.0) {
+        a.wins += 1;
+        b.losses += 1;
+      } else if (score_a == 0.0) {
+        a.losses += 1;
+        b.wins += 1;
+      } else {
+        a.draws += 1;
+        b.draws += 1;
+      }
+    }
+  }
+
+  void load() {
+    std::FILE* f = std::fopen(path_.c_str(), "rb");
+    if (!f) {
+      return;  // Nobody rated yet
+    }
+
+    char magic[5] = "";
+    uint8_t version = 0;
+    uint32_t count = 0;
+    bool ok = std::fread(magic, 1, 4, f) == 4 &&
+              std::strcmp(magic, "TTTR") == 0 &&
+              std::fread(&version, 1, 1, f) == 1 && version == 1 &&
+              read_u32(f, count);
+
+    for (uint32_t i = 0; ok && i < count; i++) {
+      uint8_t length = 0;
+      char name[256];
+      ttt_rating r;
+      ok = std::fread(&length, 1, 1, f) == 1 &&
+           std::fread(name, 1, length, f) == length &&
+           read_f64(f, r.rating) && read_u32(f, r.wins) &&
+           read_u32(f, r.losses) && read_u32(f, r.draws);
+      if (ok) {
+        table_[std::string(name, length)] = r;
+      }
+    }
+
+    std::fclose(f);
+  }
+
+  /*
+  ** Writes the table next to the file, then swaps it in, so a crash
+  ** never leaves a half-written file behind
+  */
+  bool save() {
+    std::string out = "TTTR";
+    out += char(1);
+    put_u32(out, table_.size());
+    for (const auto& entry : table_) {
+      out += char(entry.first.size());
+      out += entry.first;
+      put_f64(out, entry.second.rating);
+      put_u32(out, entry.second.wins);
+      put_u32(out, entry.second.losses);
+      put_u32(out, entry.second.draws);
+    }
+
+    const std::string tmp_path = path_ + ".tmp";
+    std::FILE* f = std::fopen(tmp_path.c_str(), "wb");
+    if (!f) {
+      return false;  // Try again on the next flush
+    }
+    const bool written =
+        std::fwrite(out.data(), 1, out.size(), f) == out.size();
+    return std::fclose(f) == 0 && written &&
+           std::rename(tmp_path.c_str(), path_.c_str()) == 0;
+  }
+
+  static void put_u32(std::string& out, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+      out += char((v >> (8 * i)) & 0xff);
+    }
+  }
+
+  static void put_f64(std::string& out, double d) {
+    uint64_t v;
+    std::memcpy(&v, &d, sizeof(v));
+    put_u32(out, uint32_t(v));
+    put_u32(out, uint32_t(v >> 32));
+  }
+
+  static bool read_u32(std::FILE* f, uint32_t& v) {
+    unsigned char b[4];
+    if (std::fread(b, 1, 4, f) != 4) {
+      return false;
+    }
+    v = b[0] | (b[1] << 8) | (b[2] << 16) | (uint32_t(b[3]) << 24);
+    return true;
+  }
+
+  static bool read_f64(std::FILE* f, double& d) {
+    uint32_t lo, hi;
+    if (!read_u32(f, lo) || !read_u32(f, hi)) {
+      return false;
+    }
+    uint64_t v = (uint64_t(hi) << 32) | lo;
+    std::memcpy(&d, &v, sizeof(d));
+    return true;
+  }
+
+ private:
+  std::string path_;
+
+  std::unordered_map<std::string, ttt_rating> table_;
+
+  ttt_write_behind<ttt_game_result, queue_capacity> results_;
+};
+
+//----------------------------------------------------------------------
+
+#endif  // ttt_ratings_hpp
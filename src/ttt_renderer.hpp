@@ -0,0 +1,263 @@
+#ifndef ttt_renderer_hpp
+#define ttt_renderer_hpp
+
+#include <array>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "ttt_shared.hpp"
+
+//------------------------------------------------------------------------------
+
+/*
+** Draws TTT Update Messages on a terminal. It remembers what is on the
+** screen and, on ANSI terminals, only rewrites the cells and lines that
+** changed, using cursor moves. Every frame goes out in a single write.
+*/
+class ttt_terminal_renderer {
+ public:
+  enum { cell_side = 7 };  // Glyph size
+  enum { board_width = ttt_board_side * (cell_side + 1) - 1 };
+  enum { board_height = board_width };
+  enum { text_row = board_height + 1 };  // First row below the board
+  enum { text_lines = 6 };               // Instructions, status, spacing
+
+  /*
+  ** 'ansi' selects incremental drawing; otherwise every frame is
+  ** printed in full, one after the other (e.g. when piped to a file)
+  */
+  ttt_terminal_renderer(std::ostream& os, bool ansi) : os_(os), ansi_(ansi) {
+    invalidate();
+  }
+
+  /*
+  ** Forgets what is on the screen, so the next frame is drawn in full
+  */
+  void invalidate() {
+    drawn_ = false;
+    for (auto& row : cells_) {
+      row.fill(glyph::none);
+    }
+    lines_.assign(text_lines, std::string());
+  }
+
+  /*
+  ** Draws a representation of a TTT game from an TTT Update Message
+  */
+  void draw(const ttt_update_message& umsg) {
+    std::vector<std::string> lines = text_for(umsg);
+    out_.clear();
+
+    if (!ansi_) {
+      draw_plain(umsg, lines);
+    } else {
+      if (!drawn_) {
+        out_ += "\x1b[2J";  // Clear the screen, then draw the grid once
+        draw_grid();
+        drawn_ = true;
+      }
+
+      for (int i = 0; i < ttt_board_side; i++) {
+        for (int j = 0; j < ttt_board_side; j++) {
+          glyph g = glyph_for(umsg, i, j);
+          if (g != cells_[i][j]) {
+            draw_cell(i, j, g);
+            cells_[i][j] = g;
+          }
+        }
+      }
+
+      for (unsigned i = 0; i < lines.size(); i++) {
+        if (lines[i] != lines_[i]) {
+          move_to(text_row + i, 0);
+          out_ += lines[i];
+          out_ += "\x1b[K";  // Erase whatever was left of the old line
+          lines_[i] = lines[i];
+        }
+      }
+
+      // Park the cursor below the frame, wiping the player's last input
+      move_to(text_row + text_lines, 0);
+      out_ += "\x1b[J";
+    }
+
+    os_.write(out_.data(), out_.size());
+    os_.flush();
+  }
+
+ private:
+  enum class glyph { none, mine, theirs };
+
+  /*
+  ** Returns the instructions and status lines for the given update
+  */
+  static std::vector<std::string> text_for(const ttt_update_message& umsg) {
+    std::vector<std::string> lines(text_lines);
+
+    if (umsg.player_id == ttt_player_id::none) {
+      spectator_text(umsg, lines);
+      return lines;
+    }
+
+    // How to play
+    if (umsg.playing) {
+      lines[0] = "HOW TO PLAY";
+      lines[1] =
+          "Type a digit from your numeric pad (numpad) to choose a cell.";
+      lines[2] =
+          "Digits correspond to cells so that the game board resembles your "
+          "numpad.";
+    }
+
+    // Game status information
+    std::string& status = lines[4];
+    if (umsg.playing) {
+      status = "Waiting for ";
+      status += (umsg.current_player == umsg.player_id ? "you"
+                                                       : "your opponent");
+      status += " to move";
+    } else if (umsg.winner == ttt_player_id::none) {
+      status = "GAME OVER, you tied!";
+    } else {
+      status = "GAME OVER, you ";
+      status += (umsg.winner == umsg.player_id ? "won!" : "lost!");
+    }
+
+    return lines;
+  }
+
+  /*
+  ** Spectators see the players by number, instead of "you"
+  */
+  static void spectator_text(const ttt_update_message& umsg,
+                             std::vector<std::string>& lines) {
+    lines[0] = "SPECTATING";
+    lines[1] = "Player 1 plays X, Player 2 plays O.";
+
+    std::string& status = lines[4];
+    if (umsg.playing) {
+      status = "Waiting for Player " +
+               std::to_string((int)umsg.current_player + 1) + " to move";
+    } else if (umsg.winner == ttt_player_id::none) {
+      status = "GAME OVER, players tied! Waiting for the next game...";
+    } else {
+      status = "GAME OVER, Player " + std::to_string((int)umsg.winner + 1) +
+               " won! Waiting for the next game...";
+    }
+  }
+
+  static glyph glyph_for(const ttt_update_message& umsg, int i, int j) {
+    if (umsg.board[i][j] == ttt_player_id::none) {
+      return glyph::none;
+    }
+    // Spectators see player 1 as X, as if they were sitting there
+    const ttt_player_id me = (umsg.player_id == ttt_player_id::none
+                                  ? ttt_player_id::player_1
+                                  : umsg.player_id);
+    return (umsg.board[i][j] == me ? glyph::mine : glyph::theirs);
+  }
+
+  /*
+  ** Returns row 'r' of a glyph, 'cell_side' chars long
+  */
+  static const char* glyph_row(glyph g, int r) {
+    static const char* const blank[cell_side] = {
+        "       ", "       ", "       ", "       ",
+        "       ", "       ", "       "};
+    static const char* const x[cell_side] = {
+        "       ", " \\   / ", "  \\ /  ", "   x   ",
+        "  / \\  ", " /   \\ ", "       "};
+    static const char* const o[cell_side] = {
+        "   _   ", "  / \\  ", " |   | ", " |   | ",
+        " |   | ", "  \\_/  ", "       "};
+
+    switch (g) {
+      case glyph::mine:
+        return x[r];
+      case glyph::theirs:
+        return o[r];
+      default:
+        return blank[r];
+    }
+  }
+
+  /*
+  ** Returns a board row, without cursor moves, for the given update
+  */
+  static std::string board_row(const ttt_update_message& umsg, int row) {
+    if (row % (cell_side + 1) == cell_side) {
+      return std::string(board_width, '-');
+    }
+
+    std::string line;
+    const int i = row / (cell_side + 1), r = row % (cell_side + 1);
+    for (int j = 0; j < ttt_board_side; j++) {
+      if (j > 0) {
+        line += '|';
+      }
+      line += glyph_row(glyph_for(umsg, i, j), r);
+    }
+    return line;
+  }
+
+  void draw_plain(const ttt_update_message& umsg,
+                  const std::vector<std::string>& lines) {
+    out_ += '\n';
+    for (int row = 0; row < board_height; row++) {
+      out_ += board_row(umsg, row);
+      out_ += '\n';
+    }
+    out_ += '\n';
+    for (const auto& line : lines) {
+      out_ += line;
+      out_ += '\n';
+    }
+  }
+
+  /*
+  ** Draws the separators between cells
+  */
+  void draw_grid() {
+    for (int row = 0; row < board_height; row++) {
+      if (row % (cell_side + 1) == cell_side) {
+        move_to(row, 0);
+        out_ += std::string(board_width, '-');
+        continue;
+      }
+      for (int j = 1; j < ttt_board_side; j++) {
+        move_to(row, j * (cell_side + 1) - 1);
+        out_ += '|';
+      }
+    }
+  }
+
+  void draw_cell(int i, int j, glyph g) {
+    for (int r = 0; r < cell_side; r++) {
+      move_to(i * (cell_side + 1) + r, j * (cell_side + 1));
+      out_ += glyph_row(g, r);
+    }
+  }
+
+  /*
+  ** Moves the cursor to a zero-based (row, col) screen position
+  */
+  void move_to(int row, int col) {
+    out_ += "\x1b[";
+    out_ += std::to_string(row + 1);
+    out_ += ';';
+    out_ += std::to_string(col + 1);
+    out_ += 'H';
+  }
+
+ private:
+  std::ostream& os_;
+  bool ansi_;
+  bool drawn_;  // Is the grid on the screen?
+  std::array<std::array<glyph, ttt_board_side>, ttt_board_side> cells_;
+  std::vector<std::string> lines_;  // Text lines on the screen
+  std::string out_;                 // Frame being built; reused
+};
+
+//------------------------------------------------------------------------------
+
+#endif  // ttt_renderer_hpp
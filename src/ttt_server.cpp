@@ -1,21 +1,214 @@
+#include <algorithm>
+#include <condition_variable>
 #include <cstdlib>
+#include <cstring>
 #include <deque>
+#include <fstream>
 #include <iostream>
 #include <list>
-#include <memory>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <utility>
 #include <string>
 #include <exception>
+#include <stdexcept>
+#include <chrono>
 #include <vector>
 #include <functional>
 #include <sstream>
+#include <thread>
+#include <unordered_map>
 #include <boost/asio.hpp>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "ttt_shared.hpp"
+#include "ttt_client_session.hpp"
+#include "ttt_game_state.hpp"
+#include "ttt_admission.hpp"
+#include "ttt_cluster.hpp"
+#include "ttt_history.hpp"
+#include "ttt_lobby.hpp"
+#include "ttt_mcts.hpp"
+#include "ttt_memory.hpp"
+#include "ttt_ratings.hpp"
+#include "ttt_trace.hpp"
 
 using boost::asio::ip::tcp;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+using boost::asio::local::stream_protocol;
+#endif
 using server_log_func = std::function<void(const std::string&)>;
 using server_do_accept_func = std::function<void()>;
+using server_result_func =
+    std::function<void(const ttt_game_result&, const ttt_game_state&)>;
+using server_changed_func = std::function<void()>;
+
+//------------------------------------------------------------------------------
+
+/*
+** How a message may be treated when a connection falls behind:
+** game state updates supersede each other, control messages do not
+*/
+enum class ttt_message_class { control, state };
+
+//------------------------------------------------------------------------------
+
+/*
+** Outgoing message queue bounded in bytes. Past the high watermark,
+** pending state updates are coalesced so only the latest one is kept,
+** until the queue drains below the low watermark again. Messages that
+** would take it past the hard limit are refused.
+**
+** Each entry holds only the bytes of its frame, in the smallest slab
+** block they fit in, and the limits count whole blocks: they bound the
+** memory a connection takes, not just what it has to send.
+*/
+class ttt_bounded_message_queue {
+ public:
+  enum { low_watermark = 4 * 1024 };
+  enum { high_watermark = 16 * 1024 };
+  enum { hard_limit = 64 * 1024 };
+
+  ttt_bounded_message_queue() {}
+
+  ttt_bounded_message_queue(const ttt_bounded_message_queue&) = delete;
+  ttt_bounded_message_queue& operator=(const ttt_bounded_message_queue&) =
+      delete;
+
+  ~ttt_bounded_message_queue() {
+    while (!empty()) {
+      pop_front();
+    }
+  }
+
+  bool empty() const { return !head_; }
+
+  /*
+  ** Memory taken by the queued entries
+  */
+  std::size_t bytes() const { return bytes_; }
+
+  /*
+  ** Memory taken by an entry holding a frame of 'length' bytes
+  */
+  static std::size_t entry_size(std::size_t length) {
+    return ttt_slab::for_size(sizeof(entry) + length).block_size();
+  }
+
+  /*
+  ** The front frame, header included
+  */
+  const char* front_data() const { return head_->frame(); }
+
+  std::size_t front_length() const { return head_->length; }
+
+  /*
+  ** Move that produced the front message, when it was queued, and the
+  ** trace lane of its write
+  */
+  uint64_t front_move() const { return head_->move; }
+
+  int front_lane() const { return head_->lane; }
+
+  ttt_span_recorder::clock::time_point front_queued() const {
+    return head_->queued;
+  }
+
+  void pop_front() {
+    entry* old = head_;
+    head_ = head_->next;
+    if (!head_) {
+      tail_ = nullptr;
+    }
+    release(old);
+
+    if (bytes_ <= low_watermark) {
+      congested_ = false;
+    }
+  }
+
+  /*
+  ** Queues a message. Returns false if it did not fit under the hard limit.
+  ** The front message is never touched, as it may be being written.
+  */
+  bool push(const ttt_message& msg, ttt_message_class cls, uint64_t move = 0,
+            ttt_span_recorder::clock::time_point queued =
+                ttt_span_recorder::clock::time_point(),
+            int lane = 0) {
+    if (congested_ && cls == ttt_message_class::state && head_) {
+      entry* prev = head_;
+      while (entry* e = prev->next) {
+        if (e->cls == ttt_message_class::state) {
+          prev->next = e->next;  // Superseded by 'msg'
+          release(e);
+        } else {
+          prev = e;
+        }
+      }
+      tail_ = prev;
+    }
+
+    const std::size_t size = entry_size(msg.length());
+    if (bytes_ + size > hard_limit) {
+      return false;
+    }
+
+    entry* e = new (ttt_slab::for_size(size).allocate()) entry;
+    e->cls = cls;
+    e->length = msg.length();
+    e->move = move;
+    e->queued = queued;
+    e->lane = lane;
+    std::memcpy(e->frame(), msg.data(), msg.length());
+    if (tail_) {
+      tail_->next = e;
+    } else {
+      head_ = e;
+    }
+    tail_ = e;
+    bytes_ += size;
+
+    if (bytes_ >= high_watermark) {
+      congested_ = true;
+    }
+    return true;
+  }
+
+ private:
+  // Singly linked in place, so an idle queue is just two pointers. The
+  // frame follows the entry in its block.
+  struct entry {
+    entry* next = nullptr;
+    ttt_message_class cls;
+    uint16_t length;
+    uint8_t lane;   // For tracing, like the two below
+    uint64_t move;
+    ttt_span_recorder::clock::time_point queued;
+
+    char* frame() { return reinterpret_cast<char*>(this + 1); }
+    const char* frame() const {
+      return reinterpret_cast<const char*>(this + 1);
+    }
+  };
+
+  static_assert(ttt_message::header_length + ttt_message::max_body_length +
+                        sizeof(entry) <=
+                    ttt_slab::max_block_size,
+                "Queue entries must fit in slab blocks");
+
+  void release(entry* e) {
+    const std::size_t size = entry_size(e->length);
+    bytes_ -= size;
+    e->~entry();
+    ttt_slab::for_size(size).deallocate(e);
+  }
+
+  entry* head_ = nullptr;
+  entry* tail_ = nullptr;
+  uint32_t bytes_ = 0;  // Never above 'hard_limit'
+  bool congested_ = false;
+};
 
 //------------------------------------------------------------------------------
 
@@ -24,28 +217,79 @@ class ttt_player {
   virtual ~ttt_player(){};
   virtual void start() = 0;
   virtual void close() = 0;
-  virtual void deliver(const ttt_message& msg) = 0;
+  virtual void deliver(const ttt_message& msg, ttt_message_class cls) = 0;
+
+  /*
+  ** Seat taken in the current game, or 'ttt_no_seat'
+  */
+  int seat() const { return seat_; }
+
+  void seat(int seat) { seat_ = seat; }
+
+  /*
+  ** Name the player gave, or empty if it did not give any
+  */
+  const std::string& name() const { return name_; }
+
+  void name(const std::string& name) { name_ = name; }
+
+  /*
+  ** Is this seat played by the server itself?
+  */
+  virtual bool is_bot() const { return false; }
+
+ private:
+  int seat_ = ttt_no_seat;
+  std::string name_;
 };
 
 //------------------------------------------------------------------------------
 
 class ttt_game {
  public:
-  ttt_game(server_log_func log, server_do_accept_func do_accept)
-      : playing_(false), log_(log), do_accept_(do_accept) {}
+  enum { max_spectators = 64 };
+
+  ttt_game(server_log_func log, server_do_accept_func do_accept,
+           server_result_func record_result = nullptr,
+           server_changed_func changed = nullptr)
+      : n_players_(0),
+        log_(log),
+        do_accept_(do_accept),
+        record_result_(record_result),
+        changed_(changed) {}
 
   /*
   ** Is there a game running?
   */
-  bool playing() const { return playing_; }
+  bool playing() const { return state_.playing(); }
+
+  /*
+  ** Rules and board of the current game
+  */
+  const ttt_game_state& state() const { return state_; }
+
+  /*
+  ** Number of games started so far, to tell them apart
+  */
+  uint64_t generation() const { return generation_; }
 
   /*
   ** Is this game looking for players?
   */
   bool looking_for_players() const {
-    return !playing() && players_.size() != ttt_number_of_players;
+    return !playing() && n_players_ != ttt_number_of_players;
   }
 
+  /*
+  ** How many players have a seat?
+  */
+  int players() const { return n_players_; }
+
+  /*
+  ** How many are watching?
+  */
+  int spectators() const { return spectators_.size(); }
+
   /*
   ** Starts a new game
   */
@@ -56,12 +300,12 @@ class ttt_game {
 
     log_("Game started!");
 
-    clear_board();
-    current_player(ttt_player_id::player_1);
-    winner_ = ttt_player_id::none;
-    playing_ = true;
+    state_.start();
+    generation_ += 1;
+    log_turn();
 
     deliver_game_state();
+    changed();
   }
 
   /*
@@ -85,18 +329,33 @@ class ttt_game {
       return;  // Ignore the request if the player is already in-game
     }
 
-    if (players_.size() == 0) {
-      players_.insert(make_pair(player, ttt_player_id::player_1));  // Add P1
-    } else {
-      auto first_player = players_.begin()->first;
-      players_[first_player] = ttt_player_id::player_1;  // Ensure we have P1
+    // Seats are kept packed, so the first player to join is always P1
+    player->seat(n_players_);
+    players_[n_players_++] = player;
+
+    player->start();
+
+    try_start_game();
+    changed();
+  }
 
-      players_.insert(make_pair(player, ttt_player_id::player_2));  // Add P2
+  /*
+  ** Lets the given player watch this game, and the ones after it.
+  ** Returns false if there are too many spectators already.
+  */
+  bool add_spectator(std::shared_ptr<ttt_player> player) {
+    if (spectators_.size() >= max_spectators) {
+      return false;
     }
 
+    spectators_.push_back(player);
     player->start();
 
-    try_start_game();
+    if (playing()) {
+      player->deliver(spectator_update(), ttt_message_class::state);
+    }
+    changed();
+    return true;
   }
 
   /*
@@ -104,74 +363,72 @@ class ttt_game {
   */
   void remove_player(std::shared_ptr<ttt_player> player) {
     if (!in_game(player)) {
+      remove_spectator(player);
       return;  // Ignore the request if the player is not in-game
     }
 
     if (playing()) {
-      ttt_player_id pid = player_id(player);
-
-      std::string text = "Player " + std::to_string((int)pid + 1) + " quitted";
+      std::string text =
+          "Player " + std::to_string(player->seat() + 1) + " quitted";
       log_(text);
 
+      // Quitting a game in progress forfeits it
+      record_result(ttt_opponent((ttt_player_id)player->seat()));
       end_game();
     } else {
       log_("A player left the game");
 
       player->close();
-      players_.erase(player);
+
+      // Shift the remaining players down, so that we still have P1
+      for (int i = player->seat() + 1; i < n_players_; i++) {
+        players_[i - 1] = std::move(players_[i]);
+        players_[i - 1]->seat(i - 1);
+      }
+      players_[--n_players_].reset();
+      player->seat(ttt_no_seat);
+      changed();
     }
   }
 
   /*
-  ** Try to make a move with a specific player
+  ** Try to make a move with the player sitting on 'seat'
   */
-  void try_move(std::shared_ptr<ttt_player> player, int x, int y) {
-    if (!playing()) {
-      return; // Ignore the request if there's no game running
-    }
-    
-    const ttt_player_id pid = player_id(player);
-
-    if (pid == ttt_player_id::none) {
-      return;  // Ignore the request if this is an invalid player
-    }
-
-    if (pid != current_player_) {
-      return;  // Ignore the request if this is not the current player
+  void try_move(int seat, int x, int y) {
+    ttt_move_result result;
+    {
+      ttt_stage_scope stage(ttt_stage::try_move);
+      result = state_.check_move(seat, x, y);
     }
-
-    if (x < 0 || x >= ttt_board_side || y < 0 || y >= ttt_board_side) {
-      return;  // Ignore the request if the cell is invalid
+    if (result != ttt_move_result::accepted) {
+      return;  // Ignore the request if the rules do not allow it
     }
-
-    if (board_[x][y] != ttt_player_id::none) {
-      return;  // Ignore the request if the given cell is already owned
+    {
+      ttt_stage_scope stage(ttt_stage::update_game_state);
+      state_.play(x, y);
     }
 
     // Log the move
     std::stringstream ss;
-    ss << "Player " << (int(pid) + 1) << " gets cell " << x << ", " << y;
+    ss << "Player " << (seat + 1) << " gets cell " << x << ", " << y;
     log_(ss.str());
 
-    // Process the move
-    board_[x][y] = pid;
-    update_game_state();
-
     // Will the game continue?
     if (playing()) {
-      current_player(next_player());  // Setup for the next turn
+      log_turn();  // Setup for the next turn
       deliver_game_state();
       return;
     }
 
     // Game over!
     deliver_game_state();
-    
+
     std::string text = "Players tied!";
-    if (winner_ != ttt_player_id::none) {
-      text = "Player " + std::to_string((int)winner_ + 1) + " wins!";
+    if (state_.winner() != ttt_player_id::none) {
+      text = "Player " + std::to_string((int)state_.winner() + 1) + " wins!";
     }
     log_(text);
+    record_result(state_.winner());
     end_game();
   }
 
@@ -185,193 +442,179 @@ class ttt_game {
 
     log_("Game over");
 
-    playing_ = false;
+    state_ = ttt_game_state();
 
-    for (auto player : players_) {
-      player.first->close();
+    for (int i = 0; i < n_players_; i++) {
+      players_[i]->close();
+      players_[i]->seat(ttt_no_seat);
+      players_[i].reset();
     }
-    players_.clear();
+    n_players_ = 0;
 
     do_accept_();
+    changed();
   }
 
  private:
   /*
-  ** Checks if ending conditions have been met,
-  ** and updates the game state correspondingly
+  ** Send an update to all players of the current game status
   */
-  void update_game_state() {
-    // Is there a winner?
-
-    std::vector<ttt_player_id> results;
-
-    for (unsigned i = 0; i < ttt_board_side; i++) {
-      results.push_back(player_on(i, 0, 0, 1));
-      results.push_back(player_on(0, i, 1, 0));
-    }
-    results.push_back(player_on(0, 0, 1, 1));
-    results.push_back(player_on(0, ttt_board_side - 1, 1, -1));
-
-    for (auto player : results) {
-      if (player != ttt_player_id::none) {
-        winner_ = player;
-        playing_ = false;
-        return;
-      }
+  void deliver_game_state() {
+    if (looking_for_players()) {
+      return;  // Skip delivery if there is no game to inform about
     }
 
-    // Is there a tie?
+    for (int i = 0; i < n_players_; i++) {
+      ttt_update_message umsg(state_.playing(), (ttt_player_id)i,
+                              state_.current_player(), state_.winner(),
+                              state_.board());
 
-    unsigned n_empty_cells = 0;
-    for (unsigned i = 0; i < ttt_board_side; i++) {
-      for (unsigned j = 0; j < ttt_board_side; j++) {
-        if (board_[i][j] == ttt_player_id::none) {
-          n_empty_cells += 1;
-        }
+      ttt_message msg;
+      {
+        ttt_stage_scope stage(ttt_stage::to_message);
+        msg = umsg.to_message();
       }
-    }
 
-    if (n_empty_cells == 0) {
-      winner_ = ttt_player_id::none;
-      playing_ = false;
+      players_[i]->deliver(msg, ttt_message_class::state);
     }
-  }
-
-  /*
-  ** Iterates 'ttt_board_side' cells of the form (sx, sy),
-  ** (sx + dx, sy + dy), (sx + 2 * dx, sy + 2 *dy), ...
-  ** and returns the player that is lying over all of them.
-  ** Returns 'none' if no player is doing so.
-  */
-  ttt_player_id player_on(int sx, int sy, int dx, int dy) {
-    ttt_player_id kind = ttt_player_id::none;
-    unsigned cnt = 0;
-
-    for (unsigned i = 0; i < ttt_board_side; i++) {
-      int x = sx + i * dx;
-      if (x < 0 || x >= ttt_board_side) {
-        continue;
-      }
-
-      int y = sy + i * dy;
-      if (y < 0 || y >= ttt_board_side) {
-        continue;
-      }
-
-      if (i == 0) {
-        kind = board_[x][y];
-      }
 
-      if (board_[x][y] == kind) {
-        cnt += 1;
+    if (!spectators_.empty()) {
+      ttt_message msg = spectator_update();
+      for (const auto& spectator : spectators_) {
+        spectator->deliver(msg, ttt_message_class::state);
       }
     }
-
-    bool found_player = (kind != ttt_player_id::none && cnt == ttt_board_side);
-    return (found_player ? kind : ttt_player_id::none);
   }
 
   /*
-  ** Clears the game board
+  ** Builds the update spectators get, which is the same for all
   */
-  void clear_board() {
-    for (unsigned i = 0; i < board_.size(); i++) {
-      for (unsigned j = 0; j < board_[i].size(); j++) {
-        board_[i][j] = ttt_player_id::none;
-      }
-    }
+  ttt_message spectator_update() const {
+    ttt_update_message umsg(state_.playing(), ttt_player_id::none,
+                            state_.current_player(), state_.winner(),
+                            state_.board());
+    ttt_stage_scope stage(ttt_stage::to_message);
+    return umsg.to_message();
   }
 
-  /*
-  ** Send an update to all players of the current game status
-  */
-  void deliver_game_state() {
-    if (looking_for_players()) {
-      return;  // Skip delivery if there is no game to inform about
+  void remove_spectator(const std::shared_ptr<ttt_player>& player) {
+    auto it = std::find(spectators_.begin(), spectators_.end(), player);
+    if (it != spectators_.end()) {
+      spectators_.erase(it);
+      player->close();
+      changed();
     }
+  }
 
-    for (auto player_id_pair : players_) {
-      ttt_player_id pid = player_id_pair.second;
-
-      ttt_update_message umsg(playing_, pid, current_player_, winner_, board_);
-
-      ttt_message msg = umsg.to_message();
-
-      player_id_pair.first->deliver(msg);
+  void changed() {
+    if (changed_) {
+      changed_();
     }
   }
 
   /*
   ** Is the given player in the game?
   */
-  bool in_game(std::shared_ptr<ttt_player> player) const {
-    return players_.count(player) > 0;
+  bool in_game(const std::shared_ptr<ttt_player>& player) const {
+    int seat = player->seat();
+    return seat >= 0 && seat < n_players_ && players_[seat] == player;
   }
 
   /*
-  ** Get player's id
+  ** Hands the outcome of the current game over to be recorded and rated.
+  ** Anonymous players have empty names.
   */
-  ttt_player_id player_id(std::shared_ptr<ttt_player> p) const {
-    if (players_.count(p) > 0) {
-      return players_.at(p);
+  void record_result(ttt_player_id winner) {
+    if (!record_result_ || n_players_ != ttt_number_of_players) {
+      return;
     }
-    return ttt_player_id::none;
-  }
 
-  /*
-  ** Returns the succesor of the current player
-  */
-  ttt_player_id next_player() {
-    if (current_player_ == ttt_player_id::player_1) {
-      return ttt_player_id::player_2;
+    ttt_game_result result;
+    result.rated = true;
+    for (int i = 0; i < n_players_; i++) {
+      const std::string& name = players_[i]->name();
+      if (name.size() >= sizeof(result.players[i])) {
+        return;
+      }
+      std::strcpy(result.players[i], name.c_str());
+      result.rated = result.rated && !name.empty() && !players_[i]->is_bot();
     }
-    return ttt_player_id::player_1;
+    result.winner = winner;
+    record_result_(result, state_);
   }
 
   /*
-  ** Sets the current player (the one whos turn is going on)
+  ** Logs whose turn is going on
   */
-  void current_player(ttt_player_id pid) {
-    std::string text =
-        "Waiting for Player " + std::to_string((int)pid + 1) + " to move";
+  void log_turn() {
+    std::string text = "Waiting for Player " +
+                       std::to_string((int)state_.current_player() + 1) +
+                       " to move";
     log_(text);
-
-    current_player_ = pid;
   }
 
  private:
-  bool playing_ = false;
-  ttt_board board_;
-  ttt_player_id current_player_;
-  ttt_player_id winner_;
-
-  std::map<std::shared_ptr<ttt_player>, ttt_player_id>
-      players_;                      // players pool
-  server_log_func log_;              // Server log function
-  server_do_accept_func do_accept_;  // Server do_accept function
+  ttt_game_state state_;  // Rules and board of the current game
+  uint64_t generation_ = 0;
+
+  std::array<std::shared_ptr<ttt_player>, ttt_number_of_players>
+      players_;                       // players pool, indexed by seat
+  int n_players_;                     // Seats taken in 'players_'
+  server_log_func log_;               // Server log function
+  server_do_accept_func do_accept_;   // Server do_accept function
+  server_result_func record_result_;  // Records finished games, if set
+  server_changed_func changed_;       // Tells about players coming and going
+  std::vector<std::shared_ptr<ttt_player>> spectators_;
 };
 
 //------------------------------------------------------------------------------
 
+template <typename Protocol>
 class ttt_remote_player : public std::enable_shared_from_this<ttt_player>,
                           public ttt_player {
  public:
-  ttt_remote_player(tcp::socket socket, ttt_game& game)
-      : socket_(std::move(socket)), game_(game) {}
+  typedef typename Protocol::socket socket_type;
+
+  ttt_remote_player(socket_type socket, ttt_game& game,
+                    ttt_admission_ticket ticket)
+      : socket_(std::move(socket)),
+        game_(game),
+        ticket_(std::move(ticket)),
+        moves_(ticket_.admission().make_move_bucket()) {}
 
   void start() { do_read_header(); }
 
-  void deliver(const ttt_message& msg) {
+  void deliver(const ttt_message& msg, ttt_message_class cls) {
+    ttt_span_recorder& recorder = ttt_span_recorder::instance();
+    const uint64_t move = recorder.current_move();
+    TTT_PROBE2(stage_begin, move, (int)ttt_stage::write);
+    ttt_span_recorder::clock::time_point queued;
+    if (recorder.sampled(move)) {
+      queued = ttt_span_recorder::clock::now();
+    }
+
+    // Writes go on the lane of their seat, after the one of the other
+    // stages, and spectators get the last one
+    const int lane =
+        (seat() == ttt_no_seat ? ttt_number_of_players + 1 : seat() + 1);
+
     bool write_in_progress = !write_msgs_.empty();
-    write_msgs_.push_back(msg);
+    if (!write_msgs_.push(msg, cls, move, queued, lane)) {
+      // The peer stopped reading. Dropping the connection makes the
+      // pending read fail, which removes the player from the game.
+      boost::system::error_code ignored_ec;
+      socket_.close(ignored_ec);
+      return;
+    }
     if (!write_in_progress) {
       do_write();
     }
   }
 
   void close() {
-    socket_.shutdown(tcp::socket::shutdown_both);
-    socket_.close();
+    boost::system::error_code ignored_ec;  // May have been dropped already
+    socket_.shutdown(socket_type::shutdown_both, ignored_ec);
+    socket_.close(ignored_ec);
   }
 
  private:
@@ -379,9 +622,9 @@ class ttt_remote_player : public std::enable_shared_from_this<ttt_player>,
     auto self(shared_from_this());
     boost::asio::async_read(
         socket_,
-        boost::asio::buffer(read_msg_.data(), ttt_message::header_length),
+        boost::asio::buffer(header_, ttt_message::header_length),
         [this, self](boost::system::error_code ec, std::size_t /*length*/) {
-          if (!ec && read_msg_.decode_header()) {
+          if (!ec && begin_body()) {
             do_read_body();
           } else {
             game_.remove_player(shared_from_this());
@@ -389,16 +632,36 @@ class ttt_remote_player : public std::enable_shared_from_this<ttt_player>,
         });
   }
 
+  /*
+  ** Takes a buffer for the body announced by the header just read.
+  ** Idle connections hold no buffer, only the header bytes.
+  */
+  bool begin_body() {
+    read_msg_ = ttt_slab_new<ttt_message>();
+    std::memcpy(read_msg_->data(), header_, ttt_message::header_length);
+    return read_msg_->decode_header();
+  }
+
   void do_read_body() {
     auto self(shared_from_this());
     boost::asio::async_read(
-        socket_, boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
+        socket_,
+        boost::asio::buffer(read_msg_->body(), read_msg_->body_length()),
         [this, self](boost::system::error_code ec, std::size_t /*length*/) {
           if (!ec) {
-            int x, y;
-            if (std::sscanf(read_msg_.body(), "%d, %d", &x, &y) == 2) {
-              game_.try_move(shared_from_this(), x, y);
+            // A move is read from here, before it gets its ID
+            ttt_span_recorder::clock::time_point received;
+            if (ttt_span_recorder::instance().enabled()) {
+              received = ttt_span_recorder::clock::now();
             }
+            if (admit_frame()) {
+              on_message(received);
+            } else if (flooding()) {
+              close();  // Flooding: shed the connection
+              game_.remove_player(shared_from_this());
+              return;
+            }
+            read_msg_.reset();  // Back to the slab until the next frame
             do_read_header();
           } else {
             game_.remove_player(shared_from_this());
@@ -406,13 +669,85 @@ class ttt_remote_player : public std::enable_shared_from_this<ttt_player>,
         });
   }
 
+  /*
+  ** Handles a frame from the player, read at 'received': moves, and on
+  ** plain servers the name sent by the client when it joins. Anything
+  ** else is ignored.
+  */
+  void on_message(ttt_span_recorder::clock::time_point received) {
+    switch (ttt_message_tag_of(*read_msg_)) {
+      case ttt_message_tag::move: {
+        ttt_move_scope move;  // Stages from here on belong to this move
+        ttt_stage_scope read_stage(ttt_stage::read, received);
+        ttt_move_message mmsg;
+        bool parsed;
+        {
+          ttt_stage_scope stage(ttt_stage::parse);
+          parsed = ttt_move_message::try_parse(*read_msg_, mmsg);
+        }
+        if (parsed) {
+          game_.try_move(seat(), mmsg.x, mmsg.y);
+        }
+        break;
+      }
+      case ttt_message_tag::join: {
+        ttt_join_message jmsg;
+        if (name().empty() && ttt_join_message::try_parse(*read_msg_, jmsg)) {
+          name(jmsg.player);  // Plain servers ignore the room
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  /*
+  ** Spends a move token of this connection and one of its address.
+  ** Frames without tokens are dropped before any parsing.
+  */
+  bool admit_frame() {
+    auto now = ttt_token_bucket::clock::now();
+    ttt_source_limits* source = ticket_.source();
+    if (moves_.try_take(now) && (!source || source->moves.try_take(now))) {
+      return true;
+    }
+    const ttt_admission_limits& limits = ticket_.admission().limits();
+    refused_frames_.add(now, limits.refused_frames_window);
+    return false;
+  }
+
+  /*
+  ** Did the peer send too many frames without tokens lately?
+  */
+  bool flooding() const {
+    return refused_frames_.count() >
+           ticket_.admission().limits().max_refused_frames;
+  }
+
+  /*
+  ** Closes the write stage of the move that produced the front message
+  */
+  void trace_written() {
+    const uint64_t move = write_msgs_.front_move();
+    TTT_PROBE2(stage_end, move, (int)ttt_stage::write);
+
+    ttt_span_recorder& recorder = ttt_span_recorder::instance();
+    if (recorder.sampled(move)) {
+      recorder.record(move, ttt_stage::write, write_msgs_.front_lane(),
+                      write_msgs_.front_queued(),
+                      ttt_span_recorder::clock::now());
+    }
+  }
+
   void do_write() {
     auto self(shared_from_this());
     boost::asio::async_write(
-        socket_, boost::asio::buffer(write_msgs_.front().data(),
-                                     write_msgs_.front().length()),
+        socket_, boost::asio::buffer(write_msgs_.front_data(),
+                                     write_msgs_.front_length()),
         [this, self](boost::system::error_code ec, std::size_t /*length*/) {
           if (!ec) {
+            trace_written();
             write_msgs_.pop_front();
             if (!write_msgs_.empty()) {
               do_write();
@@ -424,72 +759,1424 @@ class ttt_remote_player : public std::enable_shared_from_this<ttt_player>,
   }
 
  private:
-  tcp::socket socket_;
+  socket_type socket_;
   ttt_game& game_;
-  ttt_message read_msg_;
-  ttt_message_queue write_msgs_;
+  ttt_admission_ticket ticket_;  // Also holds the limits of the peer address
+  ttt_token_bucket moves_;       // Limits of this connection
+  ttt_window_counter refused_frames_;
+  char header_[ttt_message::header_length];
+  ttt_slab_ptr<ttt_message> read_msg_;  // Only while a body is being read
+  ttt_bounded_message_queue write_msgs_;
 };
 
+/*
+** Creates a remote player, with its reference counts, in a single slab
+** block
+*/
+template <typename Protocol>
+std::shared_ptr<ttt_remote_player<Protocol>> ttt_make_remote_player(
+    typename Protocol::socket socket, ttt_game& game,
+    ttt_admission_ticket ticket) {
+  return std::allocate_shared<ttt_remote_player<Protocol>>(
+      ttt_slab_allocator<ttt_remote_player<Protocol>>(), std::move(socket),
+      game, std::move(ticket));
+}
+
 //------------------------------------------------------------------------------
 
-class ttt_server {
+/*
+** Searches the moves of bots on a pool of threads, one per core, and
+** hands each one back to the thread running the games. Every worker
+** owns its search, so bots in different games think at the same time
+** and one slow search never holds up the others. A move is due
+** 'budget' after it was asked for, so requests that had to queue get
+** what is left of their budget and bots keep to it under load, playing
+** weaker instead of slower.
+*/
+class ttt_bot_engine {
  public:
-  ttt_server(boost::asio::io_service& io_service, const tcp::endpoint& endpoint)
-      : acceptor_(io_service, endpoint),
-        socket_(io_service),
-        game_([this](const std::string& msg) { this->log(msg); },
-              [this]() { this->do_accept(); }) {
-    do_accept();
+  typedef std::function<void(int cell)> move_func;
+
+  enum { nodes_per_search = 1 << 16 };
+
+  ttt_bot_engine(boost::asio::io_service& io_service,
+                 std::chrono::milliseconds budget,
+                 unsigned workers = std::thread::hardware_concurrency())
+      : io_service_(io_service), budget_(budget) {
+    for (unsigned i = 0; i < std::max(workers, 1u); i++) {
+      workers_.emplace_back([this]() { work(); });
+    }
   }
 
- private:
-  void do_accept() {
-    log("Looking for a player...");
-    acceptor_.async_accept(socket_, [this](boost::system::error_code ec) {
-      if (!ec) {
-        log("A player joined the game");
+  ~ttt_bot_engine() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
 
-        auto player =
-            std::make_shared<ttt_remote_player>(std::move(socket_), game_);
-        game_.add_player(player->shared_from_this());
-      }
+  /*
+  ** Searches a move for 'to_move', then calls 'done' with its cell
+  ** from the game thread
+  */
+  void request(const ttt_board& board, ttt_player_id to_move,
+               move_func done) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      jobs_.push_back(
+          {board, to_move, ttt_mcts::clock::now() + budget_, std::move(done)});
+    }
+    wake_.notify_one();
+  }
 
-      if (game_.looking_for_players()) {
-        do_accept();
+ private:
+  struct job {
+    ttt_board board;
+    ttt_player_id to_move;
+    ttt_mcts::clock::time_point deadline;
+    move_func done;
+  };
+
+  void work() {
+    ttt_mcts mcts(1, nodes_per_search);  // This worker's own search
+    for (;;) {
+      job j;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        wake_.wait(lock, [this]() { return stopping_ || !jobs_.empty(); });
+        if (stopping_) {
+          return;
+        }
+        j = std::move(jobs_.front());
+        jobs_.pop_front();
       }
-    });
+
+      const int cell = mcts.search(j.board, j.to_move, j.deadline);
+      io_service_.post(std::bind(std::move(j.done), cell));
+    }
   }
 
-  void log(const std::string& msg) const {
-    std::string buffer = "tic_tac_toe_server::" +
-                         std::to_string(acceptor_.local_endpoint().port()) +
-                         " '" + msg + "'\n";
-    std::cout << buffer;
+ private:
+  boost::asio::io_service& io_service_;
+  std::chrono::milliseconds budget_;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::deque<job> jobs_;
+  bool stopping_ = false;
+  std::vector<std::thread> workers_;
+};
+
+/*
+** A seat taken by the server itself. It asks the bot engine for a move
+** whenever it is its turn.
+*/
+class ttt_bot_player : public std::enable_shared_from_this<ttt_player>,
+                       public ttt_player {
+ public:
+  ttt_bot_player(ttt_game& game, ttt_bot_engine& engine)
+      : game_(game), engine_(engine) {
+    name("mcts-bot");
+  }
+
+  void start() {}
+
+  void close() { closed_ = true; }
+
+  bool is_bot() const { return true; }
+
+  void deliver(const ttt_message& /*msg*/, ttt_message_class cls) {
+    const ttt_game_state& state = game_.state();
+    if (closed_ || cls != ttt_message_class::state || !state.playing() ||
+        (int)state.current_player() != seat()) {
+      return;
+    }
+
+    auto self(shared_from_this());
+    const uint64_t generation = game_.generation();
+    const unsigned moves = state.moves();
+    engine_.request(state.board(), state.current_player(),
+                    [this, self, generation, moves](int cell) {
+                      // The game may have moved on, or even ended and
+                      // started over, while searching
+                      if (closed_ || cell < 0 ||
+                          game_.generation() != generation ||
+                          game_.state().moves() != moves) {
+                        return;
+                      }
+                      ttt_move_scope move;
+                      game_.try_move(seat(), cell / ttt_board_side,
+                                     cell % ttt_board_side);
+                    });
   }
 
  private:
-  tcp::acceptor acceptor_;
-  tcp::socket socket_;
-  ttt_game game_;
+  ttt_game& game_;
+  ttt_bot_engine& engine_;
+  bool closed_ = false;
 };
 
 //------------------------------------------------------------------------------
 
-int main(int argc, char* argv[]) {
-  try {
-    if (argc < 2) {
-      std::cerr << "Usage: server <port> [<port> ...]\n";
-      return 1;
-    }
+/*
+** Returns a printable name for a listening endpoint
+*/
+inline std::string endpoint_name(const tcp::endpoint& endpoint) {
+  return std::to_string(endpoint.port());
+}
+
+/*
+** Returns the address of the peer connected to a socket, or an empty
+** string when it has none worth limiting. Peers on this host are only
+** exempt when 'exempt_local' says so.
+*/
+inline std::string source_address(const tcp::socket& socket,
+                                  bool exempt_local) {
+  boost::system::error_code ec;
+  tcp::endpoint endpoint = socket.remote_endpoint(ec);
+  if (ec || (exempt_local && endpoint.address().is_loopback())) {
+    return std::string();
+  }
+  return endpoint.address().to_string();
+}
 
-    boost::asio::io_service io_service;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+inline std::string endpoint_name(const stream_protocol::endpoint& endpoint) {
+  return endpoint.path();
+}
+
+inline std::string source_address(const stream_protocol::socket& /*socket*/,
+                                  bool exempt_local) {
+  // Local peers have no address of their own, so they share one
+  return (exempt_local ? std::string() : std::string("local"));
+}
+#endif
+
+//------------------------------------------------------------------------------
 
-    std::list<ttt_server> servers;
-    for (int i = 1; i < argc; ++i) {
-      // El servidor se exhibe
-      tcp::endpoint endpoint(tcp::v4(), std::atoi(argv[i]));
-      servers.emplace_back(io_service, endpoint);
+/*
+** Process-wide facilities shared by every server
+*/
+struct ttt_services {
+  ttt_admission_control admission;
+  std::unique_ptr<ttt_rating_store> ratings;    // Null unless enabled
+  std::unique_ptr<ttt_history_writer> history;  // Null unless enabled
+  std::unique_ptr<ttt_bot_engine> bots;         // Null unless enabled
+
+  /*
+  ** Decides whether a freshly accepted connection is kept, limiting it
+  ** by the address of its peer
+  */
+  template <typename Socket>
+  bool admit(const Socket& socket, std::shared_ptr<ttt_source_limits>& source) {
+    return admission.admit(
+        source_address(socket, admission.limits().exempt_local), source);
+  }
+
+  /*
+  ** Seats a bot in 'game' if bots are enabled and someone waits alone
+  */
+  void seat_bot(ttt_game& game) {
+    if (bots && game.players() == 1 && game.looking_for_players()) {
+      game.add_player(std::make_shared<ttt_bot_player>(game, *bots));
     }
+  }
+
+  /*
+  ** Returns what games call when they are over
+  */
+  server_result_func result_func() {
+    if (!ratings && !history) {
+      return nullptr;
+    }
+    ttt_rating_store* store = ratings.get();
+    ttt_history_writer* writer = history.get();
+    return [store, writer](const ttt_game_result& result,
+                           const ttt_game_state& state) {
+      if (store && result.rated) {
+        store->submit(result);
+      }
+      if (writer) {
+        writer->submit(ttt_make_record(result, state));
+      }
+    };
+  }
+};
+
+//------------------------------------------------------------------------------
+
+template <typename Protocol>
+class ttt_server {
+ public:
+  typedef typename Protocol::acceptor acceptor_type;
+  typedef typename Protocol::socket socket_type;
+  typedef typename Protocol::endpoint endpoint_type;
+
+  enum { bot_wait_seconds = 10 };  // Before a lone player gets a bot
+
+  ttt_server(boost::asio::io_service& io_service, const endpoint_type& endpoint,
+             ttt_services& services)
+      : acceptor_(io_service, endpoint),
+        socket_(io_service),
+        bot_timer_(io_service),
+        name_(endpoint_name(endpoint)),
+        services_(services),
+        game_([this](const std::string& msg) { this->log(msg); },
+              [this]() { this->do_accept(); }, services.result_func()) {
+    do_accept();
+  }
+
+ private:
+  void do_accept() {
+    log("Looking for a player...");
+    acceptor_.async_accept(socket_, [this](boost::system::error_code ec) {
+      std::shared_ptr<ttt_source_limits> source;
+      if (!ec && services_.admit(socket_, source)) {
+        log("A player joined the game");
+
+        auto player = ttt_make_remote_player<Protocol>(
+            std::move(socket_), game_,
+            ttt_admission_ticket(services_.admission, std::move(source)));
+        game_.add_player(player->shared_from_this());
+        wait_for_bot();
+      } else if (!ec) {
+        boost::system::error_code ignored_ec;
+        socket_.close(ignored_ec);  // Shed it before doing any work
+      }
+
+      if (game_.looking_for_players()) {
+        do_accept();
+      }
+    });
+  }
+
+  /*
+  ** Seats a bot if the player who just joined is still alone after a
+  ** while. Whoever joins next restarts the wait.
+  */
+  void wait_for_bot() {
+    if (!services_.bots || game_.players() != 1) {
+      return;
+    }
+    bot_timer_.expires_from_now(std::chrono::seconds(bot_wait_seconds));
+    bot_timer_.async_wait([this](boost::system::error_code ec) {
+      if (!ec) {
+        services_.seat_bot(game_);
+      }
+    });
+  }
+
+  void log(const std::string& msg) const {
+    std::string buffer = "tic_tac_toe_server::" + name_ + " '" + msg + "'\n";
+    std::cout << buffer;
+  }
+
+ private:
+  acceptor_type acceptor_;
+  socket_type socket_;
+  boost::asio::steady_timer bot_timer_;
+  std::string name_;
+  ttt_services& services_;
+  ttt_game game_;
+};
+
+//------------------------------------------------------------------------------
+
+/*
+** A connection that was accepted but has not said what it wants yet.
+** It reads a single message and hands it over, along with the socket.
+** Connections that stay silent for too long are dropped.
+*/
+template <typename Protocol>
+class ttt_handshake
+    : public std::enable_shared_from_this<ttt_handshake<Protocol>> {
+ public:
+  typedef typename Protocol::socket socket_type;
+  typedef std::function<void(std::shared_ptr<ttt_handshake>,
+                             const ttt_message&)> message_func;
+
+  enum { timeout_seconds = 10 };
+
+  ttt_handshake(boost::asio::io_service& io_service, socket_type socket,
+                ttt_admission_ticket ticket, message_func on_message)
+      : socket_(std::move(socket)),
+        timer_(io_service),
+        ticket_(std::move(ticket)),
+        on_message_(on_message) {}
+
+  void start() {
+    auto self(this->shared_from_this());
+    timer_.expires_from_now(std::chrono::seconds(timeout_seconds));
+    timer_.async_wait([this, self](boost::system::error_code ec) {
+      if (!ec) {
+        close();  // Too slow: the pending read fails and we are done
+      }
+    });
+
+    do_read_header();
+  }
+
+  socket_type& socket() { return socket_; }
+
+  ttt_admission_ticket& ticket() { return ticket_; }
+
+  /*
+  ** Sends a last message, then closes the connection
+  */
+  void reply_and_close(const ttt_message& msg) {
+    reply_ = msg;
+
+    auto self(this->shared_from_this());
+    boost::asio::async_write(
+        socket_, boost::asio::buffer(reply_.data(), reply_.length()),
+        [this, self](boost::system::error_code /*ec*/, std::size_t) {
+          close();
+        });
+  }
+
+  void close() {
+    boost::system::error_code ignored_ec;
+    timer_.cancel(ignored_ec);
+    socket_.shutdown(socket_type::shutdown_both, ignored_ec);
+    socket_.close(ignored_ec);
+  }
+
+ private:
+  void do_read_header() {
+    auto self(this->shared_from_this());
+    boost::asio::async_read(
+        socket_,
+        boost::asio::buffer(read_msg_.data(), ttt_message::header_length),
+        [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+          if (!ec && read_msg_.decode_header()) {
+            do_read_body();
+          } else {
+            close();
+          }
+        });
+  }
+
+  void do_read_body() {
+    auto self(this->shared_from_this());
+    boost::asio::async_read(
+        socket_, boost::asio::buffer(read_msg_.body(), read_msg_.body_length()),
+        [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+          boost::system::error_code ignored_ec;
+          timer_.cancel(ignored_ec);
+
+          if (!ec) {
+            on_message_(self, read_msg_);
+          } else {
+            close();
+          }
+        });
+  }
+
+ private:
+  socket_type socket_;
+  boost::asio::steady_timer timer_;
+  ttt_admission_ticket ticket_;
+  message_func on_message_;
+  ttt_message read_msg_;
+  ttt_message reply_;
+};
+
+//------------------------------------------------------------------------------
+
+/*
+** A connection following the lobby of a room server. It first gets a
+** listing of the rooms, or only what changed since a version it saw,
+** then every change as it happens. Listings are sent a chunk at a
+** time, as the connection drains, so no listing is ever queued whole.
+*/
+template <typename Protocol>
+class ttt_lobby_subscriber
+    : public std::enable_shared_from_this<ttt_lobby_subscriber<Protocol>>,
+      public ttt_lobby_listener {
+ public:
+  typedef typename Protocol::socket socket_type;
+
+  enum { listing_chunk = 32 };  // Rooms fetched at a time
+  enum { max_listings = 4 };    // Before giving up on a busy index
+
+  ttt_lobby_subscriber(socket_type socket, ttt_room_index& index,
+                       ttt_admission_ticket ticket)
+      : socket_(std::move(socket)), index_(index), ticket_(std::move(ticket)) {}
+
+  void start(uint64_t epoch, uint64_t since) {
+    index_.subscribe(this);
+
+    std::vector<ttt_lobby_message> events;
+    if (since != 0 && index_.events_since(epoch, since, events)) {
+      for (const auto& lmsg : events) {
+        push(lmsg);
+      }
+      go_live();
+    } else {
+      begin_listing();
+    }
+
+    do_read_header();
+  }
+
+  void on_lobby_event(const ttt_lobby_message& lmsg) {
+    if (live_) {
+      push(lmsg);  // While listing, changes are caught up afterwards
+    }
+  }
+
+ private:
+  void begin_listing() {
+    if (++listings_ > max_listings) {
+      close();  // It changes faster than we can list it
+      return;
+    }
+
+    live_ = false;
+    snapshot_ = index_.snapshot();
+    listing_version_ = index_.version();
+    cursor_.clear();
+
+    ttt_lobby_message reset;
+    reset.epoch = index_.epoch();
+    reset.version = listing_version_;
+    reset.event = ttt_lobby_event::reset;
+    push(reset);
+    continue_listing();
+  }
+
+  /*
+  ** Queues more of the listing while there is room for it. Once done,
+  ** catches up with the changes made since its snapshot, or starts
+  ** over if the index no longer remembers them all, a few times at
+  ** most.
+  */
+  void continue_listing() {
+    while (!live_ && !closed_ &&
+           write_msgs_.bytes() < ttt_bounded_message_queue::low_watermark) {
+      std::vector<ttt_lobby_message> events;
+      const bool done = index_.listing(*snapshot_, listing_version_, cursor_,
+                                       listing_chunk, events);
+      for (const auto& lmsg : events) {
+        push(lmsg);
+      }
+      if (!events.empty()) {
+        cursor_ = events.back().room;
+      }
+
+      if (done) {
+        snapshot_.reset();
+        std::vector<ttt_lobby_message> changes;
+        if (!index_.events_since(index_.epoch(), listing_version_,
+                                 changes)) {
+          begin_listing();
+          return;
+        }
+        for (const auto& lmsg : changes) {
+          push(lmsg);
+        }
+        go_live();
+      }
+    }
+  }
+
+  void go_live() {
+    live_ = true;
+
+    ttt_lobby_message synced;
+    synced.epoch = index_.epoch();
+    synced.version = index_.version();
+    synced.event = ttt_lobby_event::synced;
+    push(synced);
+  }
+
+  void push(const ttt_lobby_message& lmsg) {
+    if (closed_) {
+      return;
+    }
+
+    bool write_in_progress = !write_msgs_.empty();
+    if (!write_msgs_.push(lmsg.to_message(), ttt_message_class::control)) {
+      close();  // Too slow: it can come back with the last version it saw
+      return;
+    }
+    if (!write_in_progress) {
+      do_write();
+    }
+  }
+
+  /*
+  ** Subscribers have nothing else to say; reading only tells when the
+  ** peer goes away
+  */
+  void do_read_header() {
+    auto self(this->shared_from_this());
+    boost::asio::async_read(
+        socket_, boost::asio::buffer(header_, ttt_message::header_length),
+        [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+          if (ec) {
+            close();
+            return;
+          }
+          ttt_message msg;
+          std::memcpy(msg.data(), header_, ttt_message::header_length);
+          if (!msg.decode_header() || msg.body_length() > 0) {
+            close();
+            return;
+          }
+          do_read_header();
+        });
+  }
+
+  void do_write() {
+    auto self(this->shared_from_this());
+    boost::asio::async_write(
+        socket_, boost::asio::buffer(write_msgs_.front_data(),
+                                     write_msgs_.front_length()),
+        [this, self](boost::system::error_code ec, std::size_t /*length*/) {
+          if (ec) {
+            close();
+            return;
+          }
+
+          write_msgs_.pop_front();
+          continue_listing();
+          if (!write_msgs_.empty()) {
+            do_write();
+          }
+        });
+  }
+
+  void close() {
+    if (closed_) {
+      return;
+    }
+    closed_ = true;
+    index_.unsubscribe(this);
+
+    boost::system::error_code ignored_ec;
+    socket_.shutdown(socket_type::shutdown_both, ignored_ec);
+    socket_.close(ignored_ec);
+  }
+
+ private:
+  socket_type socket_;
+  ttt_room_index& index_;
+  ttt_admission_ticket ticket_;
+  char header_[ttt_message::header_length];
+  ttt_bounded_message_queue write_msgs_;
+  bool live_ = false;
+  bool closed_ = false;
+  ttt_room_index::snapshot_ptr snapshot_;  // Being listed
+  uint64_t listing_version_ = 0;          // Version of 'snapshot_'
+  std::string cursor_;                    // Last room listed
+  unsigned listings_ = 0;                 // Started so far
+};
+
+//------------------------------------------------------------------------------
+
+/*
+** Hosts any number of games, called rooms, on a single endpoint.
+** Clients pick their room with a join message; rooms are created on
+** demand and forgotten once they have been empty for a while. Clients
+** may also watch a room, or follow the lobby to see them all.
+*/
+template <typename Protocol>
+class ttt_room_server {
+ public:
+  typedef typename Protocol::acceptor acceptor_type;
+  typedef typename Protocol::socket socket_type;
+  typedef typename Protocol::endpoint endpoint_type;
+
+  enum { sweep_seconds = 30 };
+
+  /*
+  ** Memory taken by every room: its game and its node in the index
+  */
+  static std::size_t room_size() {
+    std::size_t node_size = 0;
+    std::map<std::string, room, std::less<std::string>,
+             ttt_size_probe<std::pair<const std::string, room>>>
+        probe{std::less<std::string>(),
+              ttt_size_probe<std::pair<const std::string, room>>(
+                  &node_size)};
+    probe.emplace(std::string(), room());
+    return ttt_slab::for_size(sizeof(ttt_game)).block_size() +
+           ttt_slab::for_size(node_size).block_size();
+  }
+
+  ttt_room_server(boost::asio::io_service& io_service,
+                  const endpoint_type& endpoint,
+                  ttt_services& services)
+      : io_service_(io_service),
+        acceptor_(io_service, endpoint),
+        socket_(io_service),
+        sweep_timer_(io_service),
+        name_(endpoint_name(endpoint)),
+        services_(services) {
+    log("Hosting rooms");
+    do_accept();
+    schedule_sweep();
+  }
+
+ private:
+  struct room {
+    ttt_slab_ptr<ttt_game> game;
+    bool idle;  // Was it empty on the last sweep?
+  };
+
+  typedef std::map<std::string, room, std::less<std::string>,
+                   ttt_slab_allocator<std::pair<const std::string, room>>>
+      room_map;
+
+  void do_accept() {
+    acceptor_.async_accept(socket_, [this](boost::system::error_code ec) {
+      std::shared_ptr<ttt_source_limits> source;
+      if (!ec && services_.admit(socket_, source)) {
+        auto handshake = std::make_shared<ttt_handshake<Protocol>>(
+            io_service_, std::move(socket_),
+            ttt_admission_ticket(services_.admission, std::move(source)),
+            [this](std::shared_ptr<ttt_handshake<Protocol>> h,
+                   const ttt_message& msg) { on_handshake(h, msg); });
+        handshake->start();
+      } else if (!ec) {
+        boost::system::error_code ignored_ec;
+        socket_.close(ignored_ec);  // Shed it before doing any work
+      }
+
+      do_accept();
+    });
+  }
+
+  /*
+  ** Seats a connection in the room it asked to join or watch, or
+  ** subscribes it to the lobby
+  */
+  void on_handshake(std::shared_ptr<ttt_handshake<Protocol>> handshake,
+                    const ttt_message& msg) {
+    ttt_lobby_subscribe_message smsg;
+    ttt_join_message jmsg;
+    switch (ttt_message_tag_of(msg)) {
+      case ttt_message_tag::lobby_subscribe:
+        if (ttt_lobby_subscribe_message::try_parse(msg, smsg)) {
+          auto subscriber = std::make_shared<ttt_lobby_subscriber<Protocol>>(
+              std::move(handshake->socket()), index_,
+              std::move(handshake->ticket()));
+          subscriber->start(smsg.epoch, smsg.since);
+          return;
+        }
+        break;
+      case ttt_message_tag::join:
+        if (ttt_join_message::try_parse(msg, jmsg)) {
+          seat(handshake, jmsg);
+          return;
+        }
+        break;
+      default:
+        break;
+    }
+    handshake->close();
+  }
+
+  /*
+  ** Puts the connection in the room it asked for, as a player or a
+  ** spectator
+  */
+  void seat(const std::shared_ptr<ttt_handshake<Protocol>>& handshake,
+            const ttt_join_message& jmsg) {
+    room& r = find_room(jmsg.room);
+    r.idle = false;
+
+    if (jmsg.spectate) {
+      auto spectator = ttt_make_remote_player<Protocol>(
+          std::move(handshake->socket()), *r.game,
+          std::move(handshake->ticket()));
+      if (r.game->add_spectator(spectator->shared_from_this())) {
+        log("[" + jmsg.room + "] A spectator came in");
+      } else {
+        log("[" + jmsg.room + "] Too many spectators");
+        spectator->close();
+      }
+      return;
+    }
+
+    if (!r.game->looking_for_players()) {
+      log("[" + jmsg.room + "] Room is full");
+      handshake->close();
+      return;
+    }
+
+    log("[" + jmsg.room + "] A player joined the game");
+
+    auto player = ttt_make_remote_player<Protocol>(
+        std::move(handshake->socket()), *r.game,
+        std::move(handshake->ticket()));
+    player->name(jmsg.player);
+    r.game->add_player(player->shared_from_this());
+
+    if (jmsg.room.compare(0, bot_room_prefix().size(), bot_room_prefix()) ==
+        0) {
+      services_.seat_bot(*r.game);
+    }
+  }
+
+  /*
+  ** Rooms where players face a bot, when bots are enabled
+  */
+  static const std::string& bot_room_prefix() {
+    static const std::string prefix = "bot-";
+    return prefix;
+  }
+
+  room& find_room(const std::string& id) {
+    auto it = rooms_.insert(std::make_pair(id, room())).first;
+    room& r = it->second;
+    if (!r.game) {
+      // Keys stay put in the map, and a small capture is not heap allocated
+      const std::string* key = &it->first;
+      r.game = ttt_slab_new<ttt_game>(
+          [this, key](const std::string& msg) {
+            log("[" + *key + "] " + msg);
+          },
+          []() {},  // Rooms do not accept players by themselves
+          services_.result_func(), [this, key]() { publish(*key); });
+      r.idle = false;
+      publish(id);
+    }
+    return r;
+  }
+
+  /*
+  ** Tells the lobby about the current state of a room
+  */
+  void publish(const std::string& id) {
+    auto it = rooms_.find(id);
+    if (it == rooms_.end() || !it->second.game) {
+      return;
+    }
+
+    const ttt_game& game = *it->second.game;
+    ttt_room_info info;
+    info.players = game.players();
+    info.spectators = game.spectators();
+    info.playing = game.playing();
+    index_.update(id, info);
+  }
+
+  /*
+  ** Forgets rooms that stayed empty for a whole sweep period. Waiting a
+  ** period lets the players they closed finish their pending handlers.
+  */
+  void schedule_sweep() {
+    sweep_timer_.expires_from_now(std::chrono::seconds(sweep_seconds));
+    sweep_timer_.async_wait([this](boost::system::error_code ec) {
+      if (ec) {
+        return;
+      }
+
+      for (auto it = rooms_.begin(); it != rooms_.end();) {
+        room& r = it->second;
+        const bool empty = (r.game->players() == 0 &&
+                            r.game->spectators() == 0 && !r.game->playing());
+        if (empty && r.idle) {
+          index_.remove(it->first);
+          it = rooms_.erase(it);
+          continue;
+        }
+        r.idle = empty;
+        ++it;
+      }
+
+      schedule_sweep();
+    });
+  }
+
+  void log(const std::string& msg) const {
+    std::string buffer = "tic_tac_toe_server::" + name_ + " '" + msg + "'\n";
+    std::cout << buffer;
+  }
+
+ private:
+  boost::asio::io_service& io_service_;
+  acceptor_type acceptor_;
+  socket_type socket_;
+  boost::asio::steady_timer sweep_timer_;
+  std::string name_;
+  ttt_services& services_;
+  room_map rooms_;
+  ttt_room_index index_;  // What the lobby sees of 'rooms_'
+};
+
+//------------------------------------------------------------------------------
+
+/*
+** Follows the lobby of a cluster node on behalf of the front door, to
+** learn which rooms are in use there
+*/
+class ttt_node_watcher : public ttt_client_base<tcp> {
+ public:
+  typedef std::function<void(const ttt_lobby_message&)> event_func;
+
+  ttt_node_watcher(boost::asio::io_service& io_service,
+                   const tcp::endpoint& endpoint, event_func on_event)
+      : ttt_client_base<tcp>(io_service, std::vector<tcp::endpoint>{endpoint}),
+        on_event_(on_event) {}
+
+ protected:
+  void on_server_connection() override {
+    write(ttt_lobby_subscribe_message().to_message());
+  }
+
+  void on_message_received(const ttt_message& msg) override {
+    ttt_lobby_message lmsg;
+    if (ttt_lobby_message::try_parse(msg, lmsg)) {
+      on_event_(lmsg);
+    }
+  }
+
+  void log(const std::string& /*msg*/) const override {}
+
+ private:
+  event_func on_event_;
+};
+
+/*
+** Entry point of a cluster of room servers. It reads the join message
+** of each client and redirects it to the node hosting that room.
+**
+** New rooms go to the node picked by consistent hashing among the
+** nodes that are up. Rooms in use stay where they are until they
+** empty, even when nodes coming or going change the owner of their
+** ID: the front door follows the lobby of every node to know them, so
+** the second player of a room always meets the first one. Nodes are
+** probed periodically.
+*/
+class ttt_front_door {
+ public:
+  typedef std::chrono::steady_clock clock;
+
+  enum { probe_seconds = 2 };
+  enum { probe_timeout_seconds = 5 };  // Then a pending probe failed
+  enum { redirect_grace_seconds = 5 };  // For the node to list the room
+
+  ttt_front_door(boost::asio::io_service& io_service,
+                 const tcp::endpoint& endpoint,
+                 const std::vector<std::string>& nodes,
+                 ttt_services& services)
+      : io_service_(io_service),
+        acceptor_(io_service, endpoint),
+        socket_(io_service),
+        probe_timer_(io_service),
+        name_(endpoint_name(endpoint)),
+        services_(services) {
+    tcp::resolver resolver(io_service);
+    for (const auto& address : nodes) {
+      auto colon = address.rfind(':');
+      if (colon == std::string::npos) {
+        throw std::invalid_argument("Nodes must look like <host>:<port>");
+      }
+
+      std::unique_ptr<node> n(new node(io_service));
+      n->address = address;
+      n->host = address.substr(0, colon);
+      n->port = address.substr(colon + 1);
+      n->endpoint = *resolver.resolve({n->host, n->port});
+      n->up = true;  // Until a probe says otherwise
+      ring_.add_node(address);
+      nodes_.push_back(std::move(n));
+    }
+
+    log("Routing rooms to " + std::to_string(nodes_.size()) + " node(s)");
+    do_accept();
+    probe_nodes();
+  }
+
+ private:
+  struct node {
+    explicit node(boost::asio::io_service& io_service) : probe(io_service) {}
+
+    std::string address;  // "<host>:<port>", its name on the ring
+    std::string host;
+    std::string port;
+    tcp::endpoint endpoint;
+    tcp::socket probe;
+    clock::time_point probe_started;
+    unsigned probe_id = 0;  // Tells stale probe handlers apart
+    bool probing = false;
+    bool up = false;
+    std::weak_ptr<ttt_node_watcher> watcher;  // Following its lobby
+    unsigned watch_id = 0;  // Tells events of stale watchers apart
+  };
+
+  /*
+  ** Where a room in use is hosted. Rooms just redirected to a node are
+  ** routed there for a while, until its lobby lists them.
+  */
+  struct route {
+    node* host;
+    clock::time_point expires;  // 'max' once listed by the node
+  };
+
+  void do_accept() {
+    acceptor_.async_accept(socket_, [this](boost::system::error_code ec) {
+      std::shared_ptr<ttt_source_limits> source;
+      if (!ec && services_.admit(socket_, source)) {
+        auto handshake = std::make_shared<ttt_handshake<tcp>>(
+            io_service_, std::move(socket_),
+            ttt_admission_ticket(services_.admission, std::move(source)),
+            [this](std::shared_ptr<ttt_handshake<tcp>> h,
+                   const ttt_message& msg) { on_handshake(h, msg); });
+        handshake->start();
+      } else if (!ec) {
+        boost::system::error_code ignored_ec;
+        socket_.close(ignored_ec);
+      }
+
+      do_accept();
+    });
+  }
+
+  /*
+  ** Tells the client which node hosts the room it wants to join
+  */
+  void on_handshake(std::shared_ptr<ttt_handshake<tcp>> handshake,
+                    const ttt_message& msg) {
+    ttt_join_message jmsg;
+    node* n = nullptr;
+    if (ttt_join_message::try_parse(msg, jmsg)) {
+      n = host_of(jmsg.room);
+    }
+    if (!n) {
+      handshake->close();
+      return;
+    }
+    handshake->reply_and_close(
+        ttt_redirect_message(n->host, n->port).to_message());
+  }
+
+  /*
+  ** Returns the node hosting a room, or the one that should host it if
+  ** it is not in use. Returns null if no node is up.
+  */
+  node* host_of(const std::string& room) {
+    const clock::time_point now = clock::now();
+    auto it = routes_.find(room);
+    if (it != routes_.end()) {
+      if (it->second.host->up && now < it->second.expires) {
+        return it->second.host;
+      }
+      routes_.erase(it);
+    }
+
+    if (ring_.empty()) {
+      return nullptr;
+    }
+    const std::string& owner = ring_.owner(room);
+    for (const auto& n : nodes_) {
+      if (n->address == owner) {
+        routes_[room] = {n.get(),
+                         now + std::chrono::seconds(redirect_grace_seconds)};
+        return n.get();
+      }
+    }
+    return nullptr;
+  }
+
+  /*
+  ** Checks which nodes accept connections, and updates the ring. Slow
+  ** probes are given some time before they count as a failure.
+  */
+  void probe_nodes() {
+    const clock::time_point now = clock::now();
+    for (const auto& n : nodes_) {
+      if (n->probing) {
+        if (now - n->probe_started <
+            std::chrono::seconds(probe_timeout_seconds)) {
+          continue;
+        }
+        set_up(*n, false);
+      }
+
+      boost::system::error_code ignored_ec;
+      n->probe.close(ignored_ec);
+
+      node* target = n.get();
+      const unsigned id = ++n->probe_id;
+      n->probing = true;
+      n->probe_started = now;
+      n->probe.async_connect(
+          n->endpoint, [this, target, id](boost::system::error_code ec) {
+            if (id != target->probe_id) {
+              return;  // A newer probe took over
+            }
+            target->probing = false;
+            set_up(*target, !ec);
+
+            boost::system::error_code ignored_ec;
+            target->probe.close(ignored_ec);
+          });
+
+      // Lobby connections dropped by the node are made again
+      if (n->up && n->watcher.expired()) {
+        watch(*n);
+      }
+    }
+
+    // Forget redirects to rooms that never showed up
+    for (auto it = routes_.begin(); it != routes_.end();) {
+      if (it->second.expires <= now) {
+        it = routes_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    probe_timer_.expires_from_now(std::chrono::seconds(probe_seconds));
+    probe_timer_.async_wait([this](boost::system::error_code ec) {
+      if (!ec) {
+        probe_nodes();
+      }
+    });
+  }
+
+  void set_up(node& n, bool up) {
+    if (n.up == up) {
+      return;
+    }
+
+    n.up = up;
+    if (up) {
+      ring_.add_node(n.address);
+      watch(n);
+      log("Node " + n.address + " joined");
+    } else {
+      ring_.remove_node(n.address);
+      unwatch(n);
+      log("Node " + n.address + " left");
+    }
+  }
+
+  /*
+  ** Starts following the lobby of a node, which begins with a listing
+  ** of all its rooms
+  */
+  void watch(node& n) {
+    unwatch(n);
+    node* target = &n;
+    const unsigned id = n.watch_id;
+    n.watcher = ttt_start_session<ttt_node_watcher>(
+        io_service_, n.endpoint,
+        [this, target, id](const ttt_lobby_message& lmsg) {
+          if (id == target->watch_id) {
+            on_lobby_event(*target, lmsg);
+          }
+        });
+  }
+
+  /*
+  ** Stops following the lobby of a node, and forgets its rooms
+  */
+  void unwatch(node& n) {
+    n.watch_id += 1;
+    if (auto watcher = n.watcher.lock()) {
+      watcher->close();
+    }
+    n.watcher.reset();
+    forget_routes(n);
+  }
+
+  void on_lobby_event(node& n, const ttt_lobby_message& lmsg) {
+    switch (lmsg.event) {
+      case ttt_lobby_event::reset:
+        forget_routes(n);
+        break;
+      case ttt_lobby_event::add:
+      case ttt_lobby_event::update:
+        if (lmsg.players > 0 || lmsg.spectators > 0 || lmsg.playing) {
+          routes_[lmsg.room] = {&n, clock::time_point::max()};
+        } else {
+          forget_route(n, lmsg.room);  // Empty rooms may move
+        }
+        break;
+      case ttt_lobby_event::remove:
+        forget_route(n, lmsg.room);
+        break;
+      case ttt_lobby_event::synced:
+        break;
+    }
+  }
+
+  /*
+  ** Drops the route to a room once listed by the node; a room just
+  ** redirected there keeps its route until it expires
+  */
+  void forget_route(node& n, const std::string& room) {
+    auto it = routes_.find(room);
+    if (it != routes_.end() && it->second.host == &n &&
+        it->second.expires == clock::time_point::max()) {
+      routes_.erase(it);
+    }
+  }
+
+  void forget_routes(node& n) {
+    for (auto it = routes_.begin(); it != routes_.end();) {
+      if (it->second.host == &n) {
+        it = routes_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  void log(const std::string& msg) const {
+    std::string buffer = "tic_tac_toe_front::" + name_ + " '" + msg + "'\n";
+    std::cout << buffer;
+  }
+
+ private:
+  boost::asio::io_service& io_service_;
+  tcp::acceptor acceptor_;
+  tcp::socket socket_;
+  boost::asio::steady_timer probe_timer_;
+  std::string name_;
+  ttt_services& services_;
+  std::vector<std::unique_ptr<node>> nodes_;
+  ttt_hash_ring ring_;
+  std::unordered_map<std::string, route> routes_;  // Rooms in use
+};
+
+//------------------------------------------------------------------------------
+
+/*
+** Servers of one kind, listening on "<port>" or "unix:<path>" endpoints
+*/
+template <template <typename> class Server>
+class ttt_listeners {
+ public:
+  void listen(boost::asio::io_service& io_service, const std::string& arg,
+              ttt_services& services) {
+    if (arg.compare(0, 5, "unix:") == 0) {
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+      // Co-located clients skip the TCP stack entirely
+      const std::string path = arg.substr(5);
+      struct stat st;
+      if (::stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        ::unlink(path.c_str());  // Stale socket from a previous run
+      }
+      local_servers_.emplace_back(io_service, stream_protocol::endpoint(path),
+                                  services);
+      return;
+#else
+      throw std::invalid_argument("Unix domain sockets are not supported");
+#endif
+    }
+
+    // El servidor se exhibe
+    tcp::endpoint endpoint(tcp::v4(), std::atoi(arg.c_str()));
+    servers_.emplace_back(io_service, endpoint, services);
+  }
+
+ private:
+  std::list<Server<tcp>> servers_;
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  std::list<Server<stream_protocol>> local_servers_;
+#endif
+};
+
+//------------------------------------------------------------------------------
+
+/*
+** Writes the spans recorded so far to a file on SIGUSR1, and once more
+** when the server stops. Does nothing when no file was given.
+*/
+class ttt_trace_dumper {
+ public:
+  ttt_trace_dumper(boost::asio::io_service& io_service,
+                   const std::string& path)
+      : signals_(io_service), path_(path) {
+    if (!path_.empty()) {
+      signals_.add(SIGUSR1);
+      wait();
+    }
+  }
+
+  ~ttt_trace_dumper() { dump(); }
+
+ private:
+  void wait() {
+    signals_.async_wait([this](boost::system::error_code ec, int) {
+      if (!ec) {
+        dump();
+        wait();
+      }
+    });
+  }
+
+  void dump() const {
+    if (path_.empty()) {
+      return;
+    }
+    std::ofstream os(path_.c_str());
+    ttt_span_recorder::instance().dump(os);
+  }
+
+ private:
+  boost::asio::signal_set signals_;
+  std::string path_;
+};
+
+//------------------------------------------------------------------------------
+
+/*
+** Size of the slab block holding a remote player and its reference counts
+*/
+template <typename Protocol>
+std::size_t ttt_player_block_size(boost::asio::io_service& io_service) {
+  ttt_admission_control admission;
+  ttt_game game([](const std::string&) {}, []() {});
+  std::size_t size = 0;
+  std::allocate_shared<ttt_remote_player<Protocol>>(
+      ttt_size_probe<ttt_remote_player<Protocol>>(&size),
+      typename Protocol::socket(io_service), game,
+      ttt_admission_ticket(admission, nullptr));
+  return ttt_slab::for_size(size).block_size();
+}
+
+/*
+** Prints what every connection and room costs in user space memory.
+** Kernel socket buffers are not included.
+*/
+void print_memory_report(std::ostream& os) {
+  boost::asio::io_service io_service;
+  const std::size_t message_block =
+      ttt_slab::for_size(sizeof(ttt_message)).block_size();
+
+  os << "Idle TCP connection:        "
+     << ttt_player_block_size<tcp>(io_service) << " bytes\n";
+#if defined(BOOST_ASIO_HAS_LOCAL_SOCKETS)
+  os << "Idle Unix connection:       "
+     << ttt_player_block_size<stream_protocol>(io_service) << " bytes\n";
+#endif
+  os << "While reading a frame:      +" << message_block << " bytes\n"
+     << "Per queued update:          +"
+     << ttt_bounded_message_queue::entry_size(
+            ttt_message::header_length +
+            ttt_update_message::wire_schema::max_size())
+     << " bytes\n"
+     << "Per queued message, max:    +"
+     << ttt_bounded_message_queue::entry_size(
+            ttt_message::header_length + ttt_message::max_body_length)
+     << " bytes\n"
+     << "Per room (--rooms):         " << ttt_room_server<tcp>::room_size()
+     << " bytes, plus IDs over 15 chars\n";
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[]) {
+  try {
+    boost::asio::io_service io_service;
+    ttt_services services;
+
+    if (argc == 2 && std::strcmp(argv[1], "--memory-report") == 0) {
+      print_memory_report(std::cout);
+      return 0;
+    }
+
+    // Options common to every mode come first
+    int first = 1;
+    std::string trace_path;
+    ttt_admission_limits limits;
+    for (;;) {
+      if (argc > first + 1 && std::strcmp(argv[first], "--ratings") == 0) {
+        services.ratings.reset(new ttt_rating_store(argv[first + 1]));
+        first += 2;
+      } else if (argc > first + 1 &&
+                 std::strcmp(argv[first], "--history") == 0) {
+        services.history.reset(new ttt_history_writer(argv[first + 1]));
+        first += 2;
+      } else if (argc > first + 1 &&
+                 std::strcmp(argv[first], "--accept-rate") == 0) {
+        limits.accept_rate = std::atof(argv[first + 1]);
+        limits.accept_burst = 2 * limits.accept_rate;
+        first += 2;
+      } else if (argc > first + 1 &&
+                 std::strcmp(argv[first], "--exempt-local") == 0) {
+        limits.exempt_local = true;
+        first += 1;
+      } else if (argc > first + 1 && std::strcmp(argv[first], "--bot") == 0) {
+        services.bots.reset(new ttt_bot_engine(
+            io_service, std::chrono::milliseconds(std::atoi(argv[first + 1]))));
+        first += 2;
+      } else if (argc > first + 2 &&
+                 std::strcmp(argv[first], "--trace") == 0) {
+        ttt_span_recorder::instance().enable(std::atoi(argv[first + 1]));
+        trace_path = argv[first + 2];
+        first += 3;
+      } else {
+        break;
+      }
+    }
+    services.admission = ttt_admission_control(limits);
+
+    if (argc <= first) {
+      std::cerr << "Usage: server [<options>] <port>|unix:<path> "
+                   "[<port>|unix:<path> ...]\n"
+                   "       server [<options>] --rooms <port>|unix:<path> "
+                   "[<port>|unix:<path> ...]\n"
+                   "       server --front <port> <host>:<port> "
+                   "[<host>:<port> ...]\n"
+                   "       server --memory-report\n"
+                   "Options: --ratings <file>  Rate named players\n"
+                   "         --history <dir>  Record every game\n"
+                   "         --accept-rate <N>  Accept up to N connections "
+                   "per second (default 500)\n"
+                   "         --exempt-local  Let peers on this host past "
+                   "the per-address limits\n"
+                   "         --bot <ms>  Give players left waiting a bot "
+                   "opponent, thinking <ms> per move\n"
+                   "                     (room servers: at once, in rooms "
+                   "named bot-* only)\n"
+                   "         --trace <N> <file>  Trace 1 in N moves, "
+                   "dumped on SIGUSR1 and on exit\n";
+      return 1;
+    }
+
+    const std::string mode = argv[first];
+
+    ttt_listeners<ttt_server> servers;
+    ttt_listeners<ttt_room_server> room_servers;
+    std::unique_ptr<ttt_front_door> front_door;
+
+    if (mode == "--front") {
+      if (argc < first + 3) {
+        std::cerr << "The front door needs a port and some nodes\n";
+        return 1;
+      }
+      tcp::endpoint endpoint(tcp::v4(), std::atoi(argv[first + 1]));
+      std::vector<std::string> nodes(argv + first + 2, argv + argc);
+      front_door.reset(
+          new ttt_front_door(io_service, endpoint, nodes, services));
+    } else if (mode == "--rooms") {
+      for (int i = first + 1; i < argc; ++i) {
+        room_servers.listen(io_service, argv[i], services);
+      }
+    } else {
+      for (int i = first; i < argc; ++i) {
+        servers.listen(io_service, argv[i], services);
+      }
+    }
+
+    // Stop cleanly on signals, so pending ratings and games get saved
+    boost::asio::signal_set signals(io_service, SIGINT, SIGTERM);
+    signals.async_wait(
+        [&io_service](boost::system::error_code, int) { io_service.stop(); });
+
+    ttt_trace_dumper trace_dumper(io_service, trace_path);
 
     io_service.run();
   } catch (std::exception& e) {
@@ -497,4 +2184,4 @@ int main(int argc, char* argv[]) {
   }
 
   return 0;
-}
\ No newline at end of file
+}
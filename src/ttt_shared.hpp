@@ -1,17 +1,19 @@
 #ifndef ttt_shared_hpp
 #define ttt_shared_hpp
 
+#include <cctype>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <string>
 #include <exception>
 #include <vector>
 #include <array>
 #include <sstream>
 
-#include <boost/archive/text_oarchive.hpp>
-#include <boost/archive/text_iarchive.hpp>
+#include "ttt_codec.hpp"
 
 //----------------------------------------------------------------------
 
@@ -23,6 +25,82 @@ typedef std::deque<ttt_message> ttt_message_queue;
 
 //----------------------------------------------------------------------
 
+/*
+** Iterates 'ttt_board_side' cells of the form (sx, sy),
+** (sx + dx, sy + dy), (sx + 2 * dx, sy + 2 *dy), ...
+** and returns the player that is lying over all of them.
+** Returns 'none' if no player is doing so.
+*/
+inline ttt_player_id ttt_player_on(const ttt_board& board, int sx, int sy,
+                                   int dx, int dy) {
+  ttt_player_id kind = ttt_player_id::none;
+  unsigned cnt = 0;
+
+  for (unsigned i = 0; i < ttt_board_side; i++) {
+    int x = sx + i * dx;
+    if (x < 0 || x >= ttt_board_side) {
+      continue;
+    }
+
+    int y = sy + i * dy;
+    if (y < 0 || y >= ttt_board_side) {
+      continue;
+    }
+
+    if (i == 0) {
+      kind = board[x][y];
+    }
+
+    if (board[x][y] == kind) {
+      cnt += 1;
+    }
+  }
+
+  bool found_player = (kind != ttt_player_id::none && cnt == ttt_board_side);
+  return (found_player ? kind : ttt_player_id::none);
+}
+
+/*
+** Returns the player owning a whole row, column or diagonal of the board.
+** Returns 'none' if there is no such player.
+*/
+inline ttt_player_id ttt_board_winner(const ttt_board& board) {
+  for (int i = 0; i < ttt_board_side; i++) {
+    ttt_player_id row = ttt_player_on(board, i, 0, 0, 1);
+    if (row != ttt_player_id::none) {
+      return row;
+    }
+
+    ttt_player_id col = ttt_player_on(board, 0, i, 1, 0);
+    if (col != ttt_player_id::none) {
+      return col;
+    }
+  }
+
+  ttt_player_id diag = ttt_player_on(board, 0, 0, 1, 1);
+  if (diag != ttt_player_id::none) {
+    return diag;
+  }
+
+  return ttt_player_on(board, 0, ttt_board_side - 1, 1, -1);
+}
+
+/*
+** Is every cell of the board owned by some player?
+*/
+inline bool ttt_board_full(const ttt_board& board) {
+  for (unsigned i = 0; i < ttt_board_side; i++) {
+    for (unsigned j = 0; j < ttt_board_side; j++) {
+      if (board[i][j] == ttt_player_id::none) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+//----------------------------------------------------------------------
+
 class ttt_message {
  public:
   enum { header_length = 4 };
@@ -51,7 +129,7 @@ class ttt_message {
 
   bool decode_header() {
     char header[header_length + 1] = "";
-    std::strncat(header, data_, header_length);
+    std::memcpy(header, data_, header_length);
     body_length_ = std::atoi(header);
     if (body_length_ > max_body_length) {
       body_length_ = 0;
@@ -73,6 +151,301 @@ class ttt_message {
 
 //----------------------------------------------------------------------
 
+/*
+** Type of a message, as told by the byte after the protocol version.
+** Dispatching on it is a single switch; fields are only decoded by the
+** handler of the message.
+*/
+enum class ttt_message_tag : uint8_t {
+  invalid = 0,  // Wrong version, unknown type or too short
+  update,
+  move,
+  join,
+  redirect,
+  lobby_subscribe,
+  lobby,
+  last = lobby,
+
+  // Reserved for game state deltas and for resuming a dropped session.
+  // Nothing sends them yet, so they read as 'invalid' until they have a
+  // schema and a handler, and 'last' moves past them.
+  delta,
+  resume
+};
+
+template <>
+struct ttt_codec<ttt_player_id>
+    : ttt_enum_codec<ttt_player_id, ttt_player_id::none> {};
+
+inline ttt_message_tag ttt_message_tag_of(const ttt_message& msg) {
+  if (msg.body_length() < ttt_wire_header_length ||
+      uint8_t(msg.body()[0]) != ttt_protocol_version ||
+      uint8_t(msg.body()[1]) > uint8_t(ttt_message_tag::last)) {
+    return ttt_message_tag::invalid;
+  }
+  return ttt_message_tag(msg.body()[1]);
+}
+
+/*
+** Builds a message from the 'wire_schema' of its type
+*/
+template <typename Message>
+ttt_message ttt_encode(const Message& m) {
+  typedef typename Message::wire_schema schema;
+  static_assert(schema::max_size() <= ttt_message::max_body_length,
+                "Messages of this type may not fit in a frame");
+
+  ttt_message msg;
+  ttt_wire_writer w(msg.body());
+  w.put_byte(ttt_protocol_version);
+  w.put_byte(schema::tag());
+  schema::encode_fields(w, m);
+  msg.body_length(w.size());
+  msg.encode_header();
+  return msg;
+}
+
+/*
+** Fills 'm' from a message of its type, which must hold its fields and
+** nothing else
+*/
+template <typename Message>
+bool ttt_decode(const ttt_message& msg, Message& m) {
+  typedef typename Message::wire_schema schema;
+  if (uint8_t(ttt_message_tag_of(msg)) != schema::tag()) {
+    return false;
+  }
+  ttt_wire_reader r(msg.body() + ttt_wire_header_length,
+                    msg.body() + msg.body_length());
+  return schema::decode_fields(r, m) && r.done();
+}
+
+//----------------------------------------------------------------------
+
+/*
+** Asks the server to take cell (x, y) for the player
+*/
+class ttt_move_message {
+ public:
+  ttt_move_message() {}
+  ttt_move_message(int x, int y) : x(x), y(y) {}
+
+  ttt_message to_message() const { return ttt_encode(*this); }
+
+  static bool try_parse(const ttt_message& msg, ttt_move_message& mmsg) {
+    return ttt_decode(msg, mmsg);
+  }
+
+ public:
+  int x = 0;
+  int y = 0;
+
+  typedef ttt_schema<uint8_t(ttt_message_tag::move),
+                     TTT_FIELD(ttt_move_message, x),
+                     TTT_FIELD(ttt_move_message, y)>
+      wire_schema;
+};
+
+//----------------------------------------------------------------------
+
+/*
+** First message sent by a client to a server hosting rooms: the room
+** to play in, or to watch when 'spectate' is set. Plain game servers
+** only look at the player name, which identifies the player for
+** ratings.
+*/
+class ttt_join_message {
+ public:
+  enum { max_room_length = 64 };
+  enum { max_player_length = 31 };
+
+  ttt_join_message() {}
+  ttt_join_message(const std::string& room, const std::string& player)
+      : room(room), player(player) {}
+
+  ttt_message to_message() const { return ttt_encode(*this); }
+
+  static bool try_parse(const ttt_message& msg, ttt_join_message& jmsg) {
+    if (!ttt_decode(msg, jmsg)) {
+      return false;
+    }
+    if (jmsg.spectate) {
+      jmsg.player.clear();
+    }
+    return valid_room(jmsg.room) &&
+           (jmsg.player.empty() || valid_player(jmsg.player));
+  }
+
+  /*
+  ** Room IDs are short and made of letters, digits, '-' and '_'
+  */
+  static bool valid_room(const std::string& room) {
+    return valid_id(room, max_room_length);
+  }
+
+  /*
+  ** Player names follow the same rules, but are even shorter
+  */
+  static bool valid_player(const std::string& player) {
+    return valid_id(player, max_player_length);
+  }
+
+ private:
+  static bool valid_id(const std::string& id, std::size_t max_length) {
+    if (id.empty() || id.size() > max_length) {
+      return false;
+    }
+    for (char c : id) {
+      if (!std::isalnum((unsigned char)c) && c != '-' && c != '_') {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ public:
+  std::string room;
+  std::string player;     // Empty for anonymous players
+  bool spectate = false;  // Watch the room instead of playing
+
+  typedef ttt_schema<
+      uint8_t(ttt_message_tag::join), TTT_FIELD(ttt_join_message, spectate),
+      TTT_STRING_FIELD(ttt_join_message, room, max_room_length),
+      TTT_STRING_FIELD(ttt_join_message, player, max_player_length)>
+      wire_schema;
+};
+
+//----------------------------------------------------------------------
+
+/*
+** Tells a client to join its room at another server
+*/
+class ttt_redirect_message {
+ public:
+  enum { max_host_length = 253 };
+  enum { max_port_length = 32 };
+
+  ttt_redirect_message() {}
+  ttt_redirect_message(const std::string& host, const std::string& port)
+      : host(host), port(port) {}
+
+  ttt_message to_message() const { return ttt_encode(*this); }
+
+  static bool try_parse(const ttt_message& msg, ttt_redirect_message& rmsg) {
+    return ttt_decode(msg, rmsg);
+  }
+
+ public:
+  std::string host;
+  std::string port;
+
+  typedef ttt_schema<
+      uint8_t(ttt_message_tag::redirect),
+      TTT_STRING_FIELD(ttt_redirect_message, host, max_host_length),
+      TTT_STRING_FIELD(ttt_redirect_message, port, max_port_length)>
+      wire_schema;
+};
+
+//----------------------------------------------------------------------
+
+/*
+** Asks a room server for its list of rooms, and to be kept up to date.
+** With the epoch and a version seen before, only the changes made after
+** it are sent, if the same server run still remembers them.
+*/
+class ttt_lobby_subscribe_message {
+ public:
+  ttt_lobby_subscribe_message() {}
+  ttt_lobby_subscribe_message(uint64_t epoch, uint64_t since)
+      : epoch(epoch), since(since) {}
+
+  ttt_message to_message() const { return ttt_encode(*this); }
+
+  static bool try_parse(const ttt_message& msg,
+                        ttt_lobby_subscribe_message& smsg) {
+    return ttt_decode(msg, smsg);
+  }
+
+ public:
+  uint64_t epoch = 0;  // Of the server run 'since' comes from
+  uint64_t since = 0;  // Zero for a full listing
+
+  typedef ttt_schema<uint8_t(ttt_message_tag::lobby_subscribe),
+                     TTT_FIELD(ttt_lobby_subscribe_message, epoch),
+                     TTT_FIELD(ttt_lobby_subscribe_message, since)>
+      wire_schema;
+};
+
+//----------------------------------------------------------------------
+
+enum class ttt_lobby_event { reset, add, update, remove, synced };
+
+template <>
+struct ttt_codec<ttt_lobby_event>
+    : ttt_enum_codec<ttt_lobby_event, ttt_lobby_event::synced> {};
+
+/*
+** A change to the list of rooms, tagged with the version of the list
+** right after it. Versions start over when the server restarts, so
+** they come with the epoch of the server run. A full listing is a
+** 'reset', then an 'add' per room, then 'synced'; live changes follow.
+** Room fields are only meaningful for the events about a room.
+*/
+class ttt_lobby_message {
+ public:
+  ttt_message to_message() const { return ttt_encode(*this); }
+
+  static bool try_parse(const ttt_message& msg, ttt_lobby_message& lmsg) {
+    return ttt_decode(msg, lmsg);
+  }
+
+  /*
+  ** "lobby <version> <event> [<room> [<players> <spectators>
+  ** open|playing]]", for people to read
+  */
+  std::string to_string() const {
+    std::ostringstream ss;
+    ss << "lobby " << version << " " << event_name(event);
+    if (event == ttt_lobby_event::remove) {
+      ss << " " << room;
+    } else if (event == ttt_lobby_event::add ||
+               event == ttt_lobby_event::update) {
+      ss << " " << room << " " << players << " " << spectators << " "
+         << (playing ? "playing" : "open");
+    }
+    return ss.str();
+  }
+
+ private:
+  static const char* event_name(ttt_lobby_event event) {
+    static const char* const names[] = {"reset", "add", "update", "remove",
+                                        "synced"};
+    return names[(int)event];
+  }
+
+ public:
+  uint64_t epoch = 0;
+  uint64_t version = 0;
+  ttt_lobby_event event = ttt_lobby_event::reset;
+  std::string room;
+  int players = 0;
+  int spectators = 0;
+  bool playing = false;
+
+  typedef ttt_schema<
+      uint8_t(ttt_message_tag::lobby), TTT_FIELD(ttt_lobby_message, epoch),
+      TTT_FIELD(ttt_lobby_message, version),
+      TTT_FIELD(ttt_lobby_message, event),
+      TTT_STRING_FIELD(ttt_lobby_message, room,
+                       ttt_join_message::max_room_length),
+      TTT_FIELD(ttt_lobby_message, players),
+      TTT_FIELD(ttt_lobby_message, spectators),
+      TTT_FIELD(ttt_lobby_message, playing)>
+      wire_schema;
+};
+
+//----------------------------------------------------------------------
+
 class ttt_update_message {
  public:
   ttt_update_message() {}
@@ -84,52 +457,10 @@ class ttt_update_message {
         winner(winner),
         board(board) {}
 
-  ttt_message to_message() const {
-    std::ostringstream ss;
-    ss << msg_preamble();
-    {
-      boost::archive::text_oarchive oa(ss);
-      oa << (*this);
-    }
-
-    std::string msg_data = ss.str();
-
-    ttt_message msg;
-    memcpy(msg.body(), msg_data.c_str(), msg_data.size());
-    msg.body_length(msg_data.size());
-    msg.encode_header();
-
-    return msg;
-  }
+  ttt_message to_message() const { return ttt_encode(*this); }
 
   static bool try_parse(const ttt_message& msg, ttt_update_message& umsg) {
-    if (msg.body_length() < msg_preamble().size() + 1) {
-      return false; // Message body length is not long enough
-    }
-
-    if (strncmp(msg.body(), msg_preamble().c_str(), msg_preamble().size()) !=
-        0) {
-      return false; // Preamble doesn't match
-    }
-    
-    // Try to recover update message
-    try {
-      char buffer[ttt_message::max_body_length + 1];
-      unsigned object_length = msg.body_length() - msg_preamble().size();
-      
-      strncpy(buffer, msg.body() + msg_preamble().size(), object_length);
-      buffer[object_length] = 0;
-
-      std::stringstream ss(buffer);
-      {
-        boost::archive::text_iarchive ia(ss);
-        ia >> umsg;
-      }
-    } catch (boost::archive::archive_exception& e) {
-      return false;
-    }
-
-    return true;
+    return ttt_decode(msg, umsg);
   }
 
  public:
@@ -138,22 +469,14 @@ class ttt_update_message {
   ttt_player_id current_player;
   ttt_player_id winner;
   ttt_board board;
-  
- private:
-  friend class boost::serialization::access;
-  
-  static const std::string msg_preamble() {
-    return "37ffb46b-5005-4b46-bbf2-d6595d1c3cb1";
-  }
-  
-  template <class Archive>
-  void serialize(Archive& ar, const unsigned int version) {
-    ar & playing;
-    ar & player_id;
-    ar & current_player;
-    ar & winner;
-    ar & board;
-  }
+
+  typedef ttt_schema<uint8_t(ttt_message_tag::update),
+                     TTT_FIELD(ttt_update_message, playing),
+                     TTT_FIELD(ttt_update_message, player_id),
+                     TTT_FIELD(ttt_update_message, current_player),
+                     TTT_FIELD(ttt_update_message, winner),
+                     TTT_FIELD(ttt_update_message, board)>
+      wire_schema;
 };
 
 //----------------------------------------------------------------------
@@ -0,0 +1,518 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include "ttt_shared.hpp"
+#include "ttt_game_state.hpp"
+#include "ttt_mcts.hpp"
+
+//------------------------------------------------------------------------------
+
+typedef std::mt19937 ttt_rng;
+
+/*
+** Fills 'cells' with the indexes (x * side + y) of every empty cell
+*/
+inline unsigned ttt_empty_cells(const ttt_board& board, int* cells) {
+  unsigned n = 0;
+  for (int i = 0; i < ttt_number_of_cells; i++) {
+    if (board[i / ttt_board_side][i % ttt_board_side] ==
+        ttt_player_id::none) {
+      cells[n++] = i;
+    }
+  }
+  return n;
+}
+
+//------------------------------------------------------------------------------
+
+class ttt_strategy {
+ public:
+  virtual ~ttt_strategy() {}
+  virtual std::string name() const = 0;
+
+  /*
+  ** Picks a cell index (x * side + y) for 'me' to take. The board is
+  ** guaranteed to have at least one empty cell and no winner.
+  */
+  virtual int choose(const ttt_board& board, ttt_player_id me,
+                     ttt_rng& rng) const = 0;
+};
+
+//------------------------------------------------------------------------------
+
+class ttt_random_strategy : public ttt_strategy {
+ public:
+  std::string name() const override { return "random"; }
+
+  int choose(const ttt_board& board, ttt_player_id me,
+             ttt_rng& rng) const override {
+    int cells[ttt_number_of_cells];
+    unsigned n = ttt_empty_cells(board, cells);
+    return cells[std::uniform_int_distribution<unsigned>(0, n - 1)(rng)];
+  }
+};
+
+//------------------------------------------------------------------------------
+
+class ttt_heuristic_strategy : public ttt_strategy {
+ public:
+  std::string name() const override { return "heuristic"; }
+
+  /*
+  ** Wins if possible, otherwise blocks, otherwise prefers
+  ** the center, then corners, then anything left
+  */
+  int choose(const ttt_board& board, ttt_player_id me,
+             ttt_rng& rng) const override {
+    int cells[ttt_number_of_cells];
+    unsigned n = ttt_empty_cells(board, cells);
+
+    for (ttt_player_id who : {me, ttt_opponent(me)}) {
+      for (unsigned i = 0; i < n; i++) {
+        ttt_board next = board;
+        next[cells[i] / ttt_board_side][cells[i] % ttt_board_side] = who;
+        if (ttt_board_winner(next) == who) {
+          return cells[i];
+        }
+      }
+    }
+
+    const int center = ttt_number_of_cells / 2;
+    if (board[center / ttt_board_side][center % ttt_board_side] ==
+        ttt_player_id::none) {
+      return center;
+    }
+
+    int corners[4];
+    unsigned n_corners = 0;
+    for (unsigned i = 0; i < n; i++) {
+      int x = cells[i] / ttt_board_side, y = cells[i] % ttt_board_side;
+      if ((x == 0 || x == ttt_board_side - 1) &&
+          (y == 0 || y == ttt_board_side - 1)) {
+        corners[n_corners++] = cells[i];
+      }
+    }
+    if (n_corners > 0) {
+      return corners[std::uniform_int_distribution<unsigned>(
+          0, n_corners - 1)(rng)];
+    }
+
+    return cells[std::uniform_int_distribution<unsigned>(0, n - 1)(rng)];
+  }
+};
+
+//------------------------------------------------------------------------------
+
+class ttt_perfect_strategy : public ttt_strategy {
+ public:
+  /*
+  ** Solves every reachable position once, so each move is a table lookup
+  */
+  ttt_perfect_strategy()
+      : best_moves_(state_count(), 0), score_(state_count(), 0) {
+    ttt_board board;
+    for (auto& row : board) {
+      row.fill(ttt_player_id::none);
+    }
+    solved_.assign(state_count(), false);
+    solve(board, ttt_player_id::player_1);
+    solved_.clear();
+  }
+
+  std::string name() const override { return "perfect"; }
+
+  /*
+  ** Picks uniformly among the moves with the best minimax value
+  */
+  int choose(const ttt_board& board, ttt_player_id me,
+             ttt_rng& rng) const override {
+    uint16_t mask = best_moves_[encode(board)];
+
+    int cells[ttt_number_of_cells];
+    unsigned n = 0;
+    for (int i = 0; i < ttt_number_of_cells; i++) {
+      if (mask & (1 << i)) {
+        cells[n++] = i;
+      }
+    }
+    return cells[std::uniform_int_distribution<unsigned>(0, n - 1)(rng)];
+  }
+
+ private:
+  static unsigned state_count() {
+    unsigned n = 1;
+    for (int i = 0; i < ttt_number_of_cells; i++) {
+      n *= 3;
+    }
+    return n;
+  }
+
+  /*
+  ** Base-3 encoding of the board, one digit per cell
+  */
+  static unsigned encode(const ttt_board& board) {
+    unsigned code = 0;
+    for (int i = 0; i < ttt_number_of_cells; i++) {
+      code = code * 3 +
+             (unsigned)board[i / ttt_board_side][i % ttt_board_side];
+    }
+    return code;
+  }
+
+  /*
+  ** Returns the score of the position for 'to_move':
+  ** 1 if it can force a win, 0 for a draw, -1 if it loses
+  */
+  int solve(ttt_board& board, ttt_player_id to_move) {
+    const unsigned code = encode(board);
+    if (solved_[code]) {
+      return score_[code];
+    }
+
+    int cells[ttt_number_of_cells];
+    unsigned n = ttt_empty_cells(board, cells);
+
+    int best = -2;
+    uint16_t mask = 0;
+    for (unsigned i = 0; i < n; i++) {
+      const int x = cells[i] / ttt_board_side, y = cells[i] % ttt_board_side;
+      ttt_player_id& cell = board[x][y];
+      cell = to_move;
+
+      int score;
+      if (ttt_board_winner(board) == to_move) {
+        score = 1;
+      } else if (n == 1) {
+        score = 0;
+      } else {
+        score = -solve(board, ttt_opponent(to_move));
+      }
+
+      cell = ttt_player_id::none;
+
+      if (score > best) {
+        best = score;
+        mask = 0;
+      }
+      if (score == best) {
+        mask |= (1 << cells[i]);
+      }
+    }
+
+    solved_[code] = true;
+    score_[code] = best;
+    best_moves_[code] = mask;
+    return best;
+  }
+
+ private:
+  std::vector<uint16_t> best_moves_;  // Optimal cells bitmask per position
+  std::vector<int8_t> score_;         // Minimax value per position
+  std::vector<bool> solved_;          // Only used while building the table
+};
+
+//------------------------------------------------------------------------------
+
+class ttt_mcts_strategy : public ttt_strategy {
+ public:
+  enum { iterations = 4000 };
+
+  std::string name() const override { return "mcts"; }
+
+  /*
+  ** Searches a fixed number of playouts, so results do not depend on
+  ** the speed of the machine. Simulator threads already keep every core
+  ** busy, so each one searches alone, in its own engine.
+  */
+  int choose(const ttt_board& board, ttt_player_id me,
+             ttt_rng& /*rng*/) const override {
+    static thread_local ttt_mcts engine(1, 1 << 16);
+    return engine.search(board, me, ttt_mcts::clock::time_point::max(),
+                         iterations);
+  }
+};
+
+//------------------------------------------------------------------------------
+
+class ttt_work_stealing_pool {
+ public:
+  typedef std::function<void(unsigned worker)> task;
+
+  explicit ttt_work_stealing_pool(unsigned n_workers) : queues_(n_workers) {}
+
+  unsigned size() const { return queues_.size(); }
+
+  /*
+  ** Queues a task; tasks are spread round-robin over the workers
+  */
+  void submit(task t) {
+    worker_queue& q = queues_[next_queue_++ % queues_.size()];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    q.tasks.push_back(std::move(t));
+  }
+
+  /*
+  ** Runs every queued task to completion. Each worker drains its own
+  ** queue from the back and steals from the front of the others'.
+  */
+  void run() {
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < queues_.size(); i++) {
+      threads.emplace_back([this, i]() { work(i); });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+  }
+
+ private:
+  struct worker_queue {
+    std::mutex mutex;
+    std::deque<task> tasks;
+  };
+
+  void work(unsigned self) {
+    task t;
+    while (pop(self, t) || steal(self, t)) {
+      t(self);
+    }
+  }
+
+  bool pop(unsigned self, task& t) {
+    worker_queue& q = queues_[self];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.tasks.empty()) {
+      return false;
+    }
+    t = std::move(q.tasks.back());
+    q.tasks.pop_back();
+    return true;
+  }
+
+  bool steal(unsigned self, task& t) {
+    for (unsigned i = 1; i < queues_.size(); i++) {
+      worker_queue& q = queues_[(self + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (!q.tasks.empty()) {
+        t = std::move(q.tasks.front());
+        q.tasks.pop_front();
+        return true;
+      }
+    }
+    return false;  // Tasks never spawn tasks, so nothing left to do
+  }
+
+ private:
+  std::vector<worker_queue> queues_;
+  unsigned next_queue_ = 0;
+};
+
+//------------------------------------------------------------------------------
+
+struct ttt_pair_stats {
+  uint64_t games = 0;
+  uint64_t first_wins = 0;   // Wins of the first strategy of the pair
+  uint64_t second_wins = 0;  // Wins of the second strategy of the pair
+  uint64_t draws = 0;
+
+  void merge(const ttt_pair_stats& other) {
+    games += other.games;
+    first_wins += other.first_wins;
+    second_wins += other.second_wins;
+    draws += other.draws;
+  }
+};
+
+class ttt_simulator {
+ public:
+  enum { games_per_task = 4096 };
+
+  ttt_simulator(std::vector<std::unique_ptr<ttt_strategy>> strategies,
+                unsigned n_threads)
+      : strategies_(std::move(strategies)), pool_(n_threads) {}
+
+  /*
+  ** Plays 'games' games for every pair of strategies.
+  ** Seats alternate between games so neither side always moves first.
+  */
+  void run(uint64_t games, uint32_t seed) {
+    const unsigned n = strategies_.size();
+    results_.assign(n * n, ttt_pair_stats());
+
+    std::vector<std::vector<ttt_pair_stats>> partial(
+        pool_.size(), std::vector<ttt_pair_stats>(n * n));
+
+    uint32_t task_id = 0;
+    for (unsigned a = 0; a < n; a++) {
+      for (unsigned b = a; b < n; b++) {
+        for (uint64_t done = 0; done < games; done += games_per_task) {
+          uint64_t count = std::min<uint64_t>(games_per_task, games - done);
+          uint32_t task_seed = seed + task_id++;
+
+          pool_.submit([this, &partial, a, b, count, task_seed](unsigned w) {
+            ttt_rng rng(task_seed);
+            ttt_pair_stats& stats = partial[w][a * strategies_.size() + b];
+            for (uint64_t g = 0; g < count; g++) {
+              play(a, b, (g & 1) != 0, rng, stats);
+            }
+          });
+        }
+      }
+    }
+
+    pool_.run();
+
+    for (auto& worker_stats : partial) {
+      for (unsigned i = 0; i < n * n; i++) {
+        results_[i].merge(worker_stats[i]);
+      }
+    }
+  }
+
+  /*
+  ** Prints win/draw/loss statistics per strategy pair
+  */
+  void report(std::ostream& os) const {
+    const unsigned n = strategies_.size();
+    os << std::left << std::setw(24) << "pair" << std::right
+       << std::setw(12) << "games" << std::setw(10) << "A wins"
+       << std::setw(10) << "B wins" << std::setw(10) << "draws" << '\n';
+
+    os << std::fixed << std::setprecision(2);
+    for (unsigned a = 0; a < n; a++) {
+      for (unsigned b = a; b < n; b++) {
+        const ttt_pair_stats& s = results_[a * n + b];
+        if (s.games == 0) {
+          continue;
+        }
+        const double pct = 100.0 / s.games;
+        os << std::left << std::setw(24)
+           << (strategies_[a]->name() + " vs " + strategies_[b]->name())
+           << std::right << std::setw(12) << s.games << std::setw(9)
+           << s.first_wins * pct << '%' << std::setw(9)
+           << s.second_wins * pct << '%' << std::setw(9) << s.draws * pct
+           << "%\n";
+      }
+    }
+  }
+
+ private:
+  /*
+  ** Plays a single game between strategies 'a' and 'b', in memory
+  */
+  void play(unsigned a, unsigned b, bool b_starts, ttt_rng& rng,
+            ttt_pair_stats& stats) const {
+    const ttt_strategy* seats[ttt_number_of_players] = {
+        strategies_[b_starts ? b : a].get(),
+        strategies_[b_starts ? a : b].get()};
+
+    ttt_game_state game;
+    game.start();
+    while (game.playing()) {
+      const int seat = (int)game.current_player();
+      const int cell =
+          seats[seat]->choose(game.board(), game.current_player(), rng);
+      game.try_move(seat, cell / ttt_board_side, cell % ttt_board_side);
+    }
+
+    const ttt_player_id winner = game.winner();
+    stats.games += 1;
+    if (winner == ttt_player_id::none) {
+      stats.draws += 1;
+    } else if ((winner == ttt_player_id::player_1) != b_starts) {
+      stats.first_wins += 1;
+    } else {
+      stats.second_wins += 1;
+    }
+  }
+
+ private:
+  std::vector<std::unique_ptr<ttt_strategy>> strategies_;
+  ttt_work_stealing_pool pool_;
+  std::vector<ttt_pair_stats> results_;
+};
+
+//------------------------------------------------------------------------------
+
+/*
+** Builds a strategy from its command line name
+*/
+std::unique_ptr<ttt_strategy> make_strategy(const std::string& name) {
+  if (name == "random") {
+    return std::unique_ptr<ttt_strategy>(new ttt_random_strategy());
+  }
+  if (name == "heuristic") {
+    return std::unique_ptr<ttt_strategy>(new ttt_heuristic_strategy());
+  }
+  if (name == "perfect") {
+    return std::unique_ptr<ttt_strategy>(new ttt_perfect_strategy());
+  }
+  if (name == "mcts") {
+    return std::unique_ptr<ttt_strategy>(new ttt_mcts_strategy());
+  }
+  throw std::invalid_argument("Unknown strategy '" + name + "'");
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char* argv[]) {
+  try {
+    if (argc < 2) {
+      std::cerr << "Usage: simulator <games-per-pair> [<threads>] "
+                   "[<strategy> ...]\n"
+                   "Strategies: random, heuristic, perfect, mcts\n";
+      return 1;
+    }
+
+    const uint64_t games = std::strtoull(argv[1], nullptr, 10);
+
+    unsigned n_threads = std::thread::hardware_concurrency();
+    if (argc > 2) {
+      n_threads = std::atoi(argv[2]);
+    }
+    if (n_threads == 0) {
+      n_threads = 1;
+    }
+
+    std::vector<std::string> names;
+    for (int i = 3; i < argc; i++) {
+      names.push_back(argv[i]);
+    }
+    if (names.empty()) {
+      names = {"random", "heuristic", "perfect"};
+    }
+
+    std::vector<std::unique_ptr<ttt_strategy>> strategies;
+    for (const auto& name : names) {
+      strategies.push_back(make_strategy(name));
+    }
+
+    ttt_simulator simulator(std::move(strategies), n_threads);
+
+    auto start = std::chrono::steady_clock::now();
+    simulator.run(games, 0x7e57u);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    simulator.report(std::cout);
+    std::cout << "Simulated on " << n_threads << " thread(s) in "
+              << elapsed.count() << "s\n";
+  } catch (std::exception& e) {
+    std::cerr << "Exception: " << e.what() << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef ttt_spsc_queue_hpp
+#define ttt_spsc_queue_hpp
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+//----------------------------------------------------------------------
+
+/*
+** Bounded single-producer, single-consumer queue. Neither side ever
+** blocks: 'push' fails when full and 'pop' fails when empty.
+*/
+template <typename T, std::size_t Capacity>
+class ttt_spsc_queue {
+ public:
+  bool push(const T& value) {
+    const std::size_t tail = tail_.load(std::memory_order_relaxed);
+    const std::size_t next = (tail + 1) % Capacity;
+    if (next == head_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    items_[tail] = value;
+    tail_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& value) {
+    const std::size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    value = items_[head];
+    head_.store((head + 1) % Capacity, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  enum { cache_line = 64 };
+
+  // Padding keeps each index on its own cache line, so the two threads
+  // do not invalidate each other's line on every operation
+  std::array<T, Capacity> items_;
+  char pad_0_[cache_line];
+  std::atomic<std::size_t> head_{0};  // Written by the consumer
+  char pad_1_[cache_line - sizeof(std::atomic<std::size_t>)];
+  std::atomic<std::size_t> tail_{0};  // Written by the producer
+};
+
+//----------------------------------------------------------------------
+
+#endif  // ttt_spsc_queue_hpp
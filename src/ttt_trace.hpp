@@ -0,0 +1,224 @@
+#ifndef ttt_trace_hpp
+#define ttt_trace_hpp
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+//----------------------------------------------------------------------
+
+/*
+** Static USDT probes, listed by 'readelf -n' under the "ttt" provider
+** and attachable with bpftrace or perf. Each one is a single nop until
+** a tracer attaches. Without <sys/sdt.h> they compile to nothing.
+*/
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TTT_HAVE_SDT 1
+#endif
+#endif
+
+#if defined(TTT_HAVE_SDT)
+#define TTT_PROBE2(name, a, b) DTRACE_PROBE2(ttt, name, a, b)
+#else
+#define TTT_PROBE2(name, a, b) \
+  do {                         \
+    (void)(a);                 \
+    (void)(b);                 \
+  } while (0)
+#endif
+
+//----------------------------------------------------------------------
+
+/*
+** Stages a move goes through on the server. Probes pass them as
+** integers: 'stage_begin' and 'stage_end' get (move ID, stage).
+*/
+enum class ttt_stage : int {
+  read,               // From a move frame arriving to it being handled
+  parse,              // Parsing the frame
+  try_move,           // Applying the rules
+  update_game_state,  // Looking for a winner
+  to_message,         // Serializing an update
+  write               // From queueing an update to its write completion
+};
+
+inline const char* ttt_stage_name(ttt_stage stage) {
+  static const char* const names[] = {"read",     "parse",
+                                      "try_move", "update_game_state",
+                                      "to_message", "write"};
+  return names[(int)stage];
+}
+
+//----------------------------------------------------------------------
+
+/*
+** Keeps the timings of one in every N moves in a ring buffer, to be
+** dumped as Chrome trace JSON (chrome://tracing, Perfetto). It is off
+** until enabled, and then only costs a division per move that is not
+** sampled. Not thread safe: it belongs to the thread running the games.
+*/
+class ttt_span_recorder {
+ public:
+  typedef std::chrono::steady_clock clock;
+
+  static ttt_span_recorder& instance() {
+    static ttt_span_recorder recorder;
+    return recorder;
+  }
+
+  void enable(unsigned sample_every, std::size_t capacity = 64 * 1024) {
+    sample_every_ = sample_every;
+    spans_.assign(capacity, span());
+    next_ = 0;
+    wrapped_ = false;
+  }
+
+  bool enabled() const { return sample_every_ != 0; }
+
+  /*
+  ** Move being handled right now, for stages deep in the call stack.
+  ** Zero outside of a 'ttt_move_scope'.
+  */
+  uint64_t current_move() const { return current_; }
+
+  bool sampled(uint64_t move) const {
+    return sample_every_ != 0 && move != 0 && move % sample_every_ == 0;
+  }
+
+  void record(uint64_t move, ttt_stage stage, int lane,
+              clock::time_point begin, clock::time_point end) {
+    span& s = spans_[next_];
+    s.move = move;
+    s.stage = stage;
+    s.lane = lane;
+    s.begin = begin;
+    s.end = end;
+    if (++next_ == spans_.size()) {
+      next_ = 0;
+      wrapped_ = true;
+    }
+  }
+
+  /*
+  ** Writes the spans kept so far, oldest first. Each move gets its own
+  ** row in the viewer; writes to each seat, and to spectators, go on
+  ** lanes of their own.
+  */
+  void dump(std::ostream& os) const {
+    os << "{\"traceEvents\":[";
+    const std::size_t count = (wrapped_ ? spans_.size() : next_);
+    const std::size_t first = (wrapped_ ? next_ : 0);
+    for (std::size_t i = 0; i < count; i++) {
+      const span& s = spans_[(first + i) % spans_.size()];
+      os << (i ? ",\n" : "\n") << "{\"name\":\"" << ttt_stage_name(s.stage)
+         << "\",\"cat\":\"ttt\",\"ph\":\"X\",\"pid\":" << s.move
+         << ",\"tid\":" << s.lane << ",\"ts\":" << micros(s.begin)
+         << ",\"dur\":" << micros(s.end) - micros(s.begin)
+         << ",\"args\":{\"move\":" << s.move << "}}";
+    }
+    os << "\n]}\n";
+  }
+
+ private:
+  friend class ttt_move_scope;
+
+  struct span {
+    uint64_t move;
+    ttt_stage stage;
+    int lane;
+    clock::time_point begin;
+    clock::time_point end;
+  };
+
+  static long long micros(clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               t.time_since_epoch())
+        .count();
+  }
+
+ private:
+  unsigned sample_every_ = 0;  // Zero when disabled
+  uint64_t last_move_ = 0;
+  uint64_t current_ = 0;
+  std::vector<span> spans_;
+  std::size_t next_ = 0;
+  bool wrapped_ = false;
+};
+
+//----------------------------------------------------------------------
+
+/*
+** Numbers a new move and makes it the current one while in scope; the
+** previous one is current again afterwards. IDs are handed out even
+** when disabled, so probes can tell moves apart.
+*/
+class ttt_move_scope {
+ public:
+  ttt_move_scope() {
+    ttt_span_recorder& recorder = ttt_span_recorder::instance();
+    previous_ = recorder.current_;
+    recorder.current_ = ++recorder.last_move_;
+  }
+
+  ttt_move_scope(const ttt_move_scope&) = delete;
+  ttt_move_scope& operator=(const ttt_move_scope&) = delete;
+
+  ~ttt_move_scope() { ttt_span_recorder::instance().current_ = previous_; }
+
+ private:
+  uint64_t previous_;
+};
+
+//----------------------------------------------------------------------
+
+/*
+** Marks a stage of the current move for as long as it is in scope:
+** fires the probes and, if the move is sampled, records its span
+*/
+class ttt_stage_scope {
+ public:
+  explicit ttt_stage_scope(
+      ttt_stage stage,
+      uint64_t move = ttt_span_recorder::instance().current_move())
+      : stage_(stage), move_(move) {
+    TTT_PROBE2(stage_begin, move_, (int)stage_);
+    if (ttt_span_recorder::instance().sampled(move_)) {
+      begin_ = ttt_span_recorder::clock::now();
+    }
+  }
+
+  /*
+  ** Same, for a stage of the current move that began at 'begin',
+  ** before the move had an ID
+  */
+  ttt_stage_scope(ttt_stage stage, ttt_span_recorder::clock::time_point begin)
+      : stage_(stage),
+        move_(ttt_span_recorder::instance().current_move()),
+        begin_(begin) {
+    TTT_PROBE2(stage_begin, move_, (int)stage_);
+  }
+
+  ttt_stage_scope(const ttt_stage_scope&) = delete;
+  ttt_stage_scope& operator=(const ttt_stage_scope&) = delete;
+
+  ~ttt_stage_scope() {
+    TTT_PROBE2(stage_end, move_, (int)stage_);
+    ttt_span_recorder& recorder = ttt_span_recorder::instance();
+    if (recorder.sampled(move_)) {
+      recorder.record(move_, stage_, 0, begin_,
+                      ttt_span_recorder::clock::now());
+    }
+  }
+
+ private:
+  ttt_stage stage_;
+  uint64_t move_;
+  ttt_span_recorder::clock::time_point begin_;
+};
+
+//----------------------------------------------------------------------
+
+#endif  // ttt_trace_hpp
@@ -0,0 +1,175 @@
+#ifndef ttt_write_behind_hpp
+#define ttt_write_behind_hpp
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ttt_spsc_queue.hpp"
+
+//----------------------------------------------------------------------
+
+/*
+** Takes values from the game thread and hands them to a background
+** thread in batches, which also flushes them to storage now and then.
+** The game thread goes through a lock-free queue; only when it is full
+** do values wait in an overflow list, under a lock the worker holds
+** briefly. The worker drains that list on every batch and once more
+** when stopping, so nothing submitted is ever left behind. Past
+** 'max_overflow' values, new ones are dropped and counted.
+**
+** Values are applied in the order they were submitted.
+*/
+template <typename T, std::size_t Capacity>
+class ttt_write_behind {
+ public:
+  enum { max_overflow = 16 * Capacity };
+
+  // Worker thread: applies a batch, and saves what was applied so far
+  typedef std::function<void(const std::vector<T>&)> apply_func;
+  typedef std::function<bool()> flush_func;  // False to retry later
+
+  ttt_write_behind(std::chrono::milliseconds batch_period,
+                   std::chrono::seconds flush_period)
+      : batch_period_(batch_period), flush_period_(flush_period) {}
+
+  ttt_write_behind(const ttt_write_behind&) = delete;
+  ttt_write_behind& operator=(const ttt_write_behind&) = delete;
+
+  ~ttt_write_behind() { stop(); }
+
+  /*
+  ** Starts the worker. Owners call it once they are fully built.
+  */
+  void start(apply_func apply, flush_func flush) {
+    apply_ = apply;
+    flush_ = flush;
+    worker_ = std::thread([this]() { work(); });
+  }
+
+  /*
+  ** Applies and flushes everything submitted so far, then stops the
+  ** worker. Owners call it before their state goes away.
+  */
+  void stop() {
+    if (!worker_.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    worker_.join();
+  }
+
+  /*
+  ** Queues a value. Called from the game thread only; it never waits
+  ** for storage.
+  */
+  void submit(const T& value) {
+    if (!overflowing_.load(std::memory_order_relaxed) && queue_.push(value)) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(overflow_mutex_);
+    if (!overflowing_.load(std::memory_order_relaxed) && queue_.push(value)) {
+      return;  // The worker caught up meanwhile
+    }
+    if (overflow_.size() >= max_overflow) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    overflow_.push_back(value);
+    overflowing_.store(true, std::memory_order_relaxed);
+  }
+
+  /*
+  ** Values dropped so far because the worker fell too far behind
+  */
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  void work() {
+    auto last_flush = std::chrono::steady_clock::now();
+    std::vector<T> batch;
+    bool dirty = false;
+
+    for (;;) {
+      bool stopping;
+      {
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        wake_.wait_for(lock, batch_period_, [this]() { return stopping_; });
+        stopping = stopping_;
+      }
+
+      take(batch);
+      if (!batch.empty()) {
+        apply_(batch);
+        batch.clear();
+        dirty = true;
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      if (dirty && (stopping || now - last_flush >= flush_period_)) {
+        dirty = !flush_();
+        last_flush = now;
+      }
+
+      if (stopping) {
+        return;
+      }
+    }
+  }
+
+  /*
+  ** Moves every value submitted so far into 'batch'. While values
+  ** overflow, the game thread leaves the queue alone, so the queue
+  ** holds older values than the overflow list.
+  */
+  void take(std::vector<T>& batch) {
+    T value;
+    while (queue_.pop(value)) {
+      batch.push_back(value);
+    }
+
+    std::lock_guard<std::mutex> lock(overflow_mutex_);
+    if (!overflowing_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    while (queue_.pop(value)) {
+      batch.push_back(value);
+    }
+    batch.insert(batch.end(), overflow_.begin(), overflow_.end());
+    overflow_.clear();
+    overflowing_.store(false, std::memory_order_relaxed);
+  }
+
+ private:
+  std::chrono::milliseconds batch_period_;
+  std::chrono::seconds flush_period_;
+  apply_func apply_;
+  flush_func flush_;
+
+  ttt_spsc_queue<T, Capacity> queue_;
+  std::mutex overflow_mutex_;
+  std::deque<T> overflow_;
+  std::atomic<bool> overflowing_{false};  // Is 'overflow_' in use?
+  std::atomic<uint64_t> dropped_{0};
+
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  bool stopping_ = false;
+  std::thread worker_;
+};
+
+//----------------------------------------------------------------------
+
+#endif  // ttt_write_behind_hpp